@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Compare the metrics of one perf-gate workload against the stored baseline.
+
+Baselines are measured values, stored per named reference configuration,
+i.e. a machine and build type. Metrics ending in _mbps must not drop below
+baseline * (1 - tolerance), and metrics ending in _mb (memory) must not grow
+above baseline * (1 + tolerance). Without a recorded baseline for the
+configuration and workload, the check fails, since a gate that skips would
+pass any regression. With --update, store the measured metrics as the new
+baseline of the configuration instead.
+"""
+import argparse
+import datetime
+import json
+import subprocess
+import sys
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--baseline', required=True, help='baseline JSON file')
+    parser.add_argument('--configuration', default='',
+                        help='name of the reference configuration to compare against')
+    parser.add_argument('--update', action='store_true',
+                        help='overwrite the baseline with the measured metrics')
+    parser.add_argument('perf_gate', help='path to the perf-gate executable')
+    parser.add_argument('workload', help='workload name')
+    args = parser.parse_args()
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    configurations = baseline['configurations']
+
+    if not args.configuration:
+        print('No reference configuration selected (-Dperf_reference)')
+        return 1
+
+    reference = configurations.get(args.configuration, {})
+    if not args.update and args.workload not in reference.get('workloads', {}):
+        print('No baseline of {} recorded for configuration {}; record one with --update'.format(
+            args.workload, args.configuration))
+        return 1
+
+    output = subprocess.run([args.perf_gate, args.workload], check=True,
+                            stdout=subprocess.PIPE, universal_newlines=True).stdout
+    lines = output.strip().splitlines()
+    environment = lines[:-1]
+    for line in environment:
+        print(line)
+    measured = json.loads(lines[-1])
+    del measured['workload']
+
+    if args.update:
+        reference = configurations.setdefault(args.configuration, {'workloads': {}})
+        reference['workloads'][args.workload] = {
+            'environment': environment,
+            'recorded': datetime.date.today().isoformat(),
+            'metrics': {k: round(v, 1) for k, v in measured.items()},
+        }
+        with open(args.baseline, 'w') as f:
+            json.dump(baseline, f, indent=4, sort_keys=True)
+            f.write('\n')
+        return 0
+
+    recorded = reference['workloads'][args.workload]
+    print('configuration {}, recorded {} with {}'.format(
+        args.configuration, recorded['recorded'], '; '.join(recorded['environment'])))
+    tolerance = baseline['tolerance']
+
+    ok = True
+    for key, value_ref in sorted(recorded['metrics'].items()):
+        value = measured[key]
+        if key.endswith('_mbps'):
+            limit = value_ref * (1 - tolerance['throughput'])
+            passed = value >= limit
+            bound = '>='
+        else:
+            limit = value_ref * (1 + tolerance['memory'])
+            passed = value <= limit
+            bound = '<='
+
+        print('{:<12} {:10.1f}  (baseline {:.1f}, want {} {:.1f})  {}'.format(
+            key, value, value_ref, bound, limit, 'ok' if passed else 'REGRESSION'))
+        ok &= passed
+
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "charls/charls.h"
+#include "cpu-quota.h"
+#include "jpegls-filter.h"
+#include "synthetic.h"
+
+namespace {
+
+using synthetic::clock_type;
+using synthetic::toMBps;
+
+struct workload_t {
+    const char* name;
+    unsigned int width;
+    unsigned int height;
+    unsigned int typesize;
+    size_t repeats;
+    unsigned int options = 0;
+    unsigned int threads = 0;
+    unsigned int subchunks = 0;
+
+    /** All samples equal, e.g. a masked or zero-filled frame. */
+    bool uniform = false;
+};
+
+/** Encode and decode the same chunk repeatedly through the plugin entry
+ * point, and report the throughput in raw (uncompressed) MB/s. */
+bool
+run(const workload_t& w) {
+    const std::vector<unsigned int> cd_values{w.width,   w.height,  w.typesize, 0,
+                                              w.options, w.threads, w.subchunks};
+
+    const auto raw = (w.uniform) ? synthetic::makeUniformFrame(w.width, w.height, w.typesize)
+                                 : synthetic::makeFrame(w.width, w.height, w.typesize);
+
+    // Encode
+    std::vector<uint8_t> encoded;
+    clock_type::duration encode_time{};
+    for (size_t i = 0; i < w.repeats; i++) {
+        encoded = synthetic::runFilter(0, cd_values, raw, encode_time);
+    }
+
+    // Decode
+    bool is_equal = true;
+    clock_type::duration decode_time{};
+    for (size_t i = 0; i < w.repeats; i++) {
+        is_equal &= synthetic::runFilter(H5Z_FLAG_REVERSE, cd_values, encoded, decode_time) == raw;
+    }
+
+    const size_t total_bytes = raw.size() * w.repeats;
+    std::cout << std::left << std::setw(24) << w.name << std::right << std::fixed
+              << std::setprecision(1) << " ratio " << std::setw(5)
+              << double(raw.size()) / encoded.size() << "  encode " << std::setw(8)
+              << toMBps(total_bytes, encode_time) << " MB/s  decode " << std::setw(8)
+              << toMBps(total_bytes, decode_time) << " MB/s" << (is_equal ? "" : "  MISMATCH")
+              << '\n';
+
+    return is_equal;
+}
+
+/** Decode small chunks one at a time, as an interactive viewer would, while
+ * another thread encodes or decodes large chunks in bulk, and report the
+ * latency of the small chunks when they are scheduled in the given lane. */
+bool
+runMixed(const char* name, int priority, bool bulk_decode) {
+    const std::vector<unsigned int> bulk_cd{2048, 2048, 2, 0, 0, 0, 0};
+    // Large enough to go through the pool rather than the inline path.
+    const std::vector<unsigned int> small_cd{512, 128, 2, 0, 0, 0, 0};
+    const auto bulk_raw = synthetic::makeFrame(2048, 2048, 2);
+    const auto small_raw = synthetic::makeFrame(512, 128, 2);
+
+    clock_type::duration unused{};
+    const auto small_encoded = synthetic::runFilter(0, small_cd, small_raw, unused);
+    const auto bulk_encoded = synthetic::runFilter(0, bulk_cd, bulk_raw, unused);
+
+    std::atomic<bool> stop{false};
+    size_t bulk_chunks = 0;
+    clock_type::duration bulk_time{};
+    std::thread bulk([&] {
+        h5jpegls_set_priority(jpegls::PRIORITY_THROUGHPUT);
+        while (!stop) {
+            if (bulk_decode) {
+                synthetic::runFilter(H5Z_FLAG_REVERSE, bulk_cd, bulk_encoded, bulk_time);
+            } else {
+                synthetic::runFilter(0, bulk_cd, bulk_raw, bulk_time);
+            }
+            bulk_chunks++;
+        }
+    });
+
+    h5jpegls_set_priority(priority);
+    bool is_equal = true;
+    std::vector<clock_type::duration> latency;
+    for (size_t i = 0; i < 200; i++) {
+        clock_type::duration elapsed{};
+        is_equal &=
+            synthetic::runFilter(H5Z_FLAG_REVERSE, small_cd, small_encoded, elapsed) == small_raw;
+        latency.push_back(elapsed);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    h5jpegls_set_priority(jpegls::PRIORITY_DATASET);
+
+    stop = true;
+    bulk.join();
+
+    std::sort(latency.begin(), latency.end());
+    const auto ms = [](clock_type::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+              << std::setprecision(2) << " p50 " << std::setw(8) << ms(latency[latency.size() / 2])
+              << " ms  p99 " << std::setw(8) << ms(latency[latency.size() * 99 / 100])
+              << " ms  bulk " << (bulk_decode ? "decode " : "encode ") << std::setprecision(1)
+              << std::setw(8)
+              << toMBps(bulk_raw.size() * bulk_chunks, bulk_time) << " MB/s"
+              << (is_equal ? "" : "  MISMATCH") << '\n';
+
+    return is_equal;
+}
+
+/** Encode and decode tiny chunks one after another, where the fixed cost of a
+ * filter call dominates, and report the chunks per second. */
+bool
+runSmall(const char* name, unsigned int width, unsigned int height, size_t repeats) {
+    const std::vector<unsigned int> cd_values{width, height, 2, 0, 0, 0, 0};
+    const auto raw = synthetic::makeFrame(width, height, 2);
+
+    std::vector<uint8_t> encoded;
+    clock_type::duration encode_time{};
+    for (size_t i = 0; i < repeats; i++) {
+        encoded = synthetic::runFilter(0, cd_values, raw, encode_time);
+    }
+
+    bool is_equal = true;
+    clock_type::duration decode_time{};
+    for (size_t i = 0; i < repeats; i++) {
+        is_equal &= synthetic::runFilter(H5Z_FLAG_REVERSE, cd_values, encoded, decode_time) == raw;
+    }
+
+    const auto per_second = [&](clock_type::duration elapsed) {
+        return repeats / std::chrono::duration<double>(elapsed).count();
+    };
+    std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+              << std::setprecision(0) << " encode " << std::setw(9) << per_second(encode_time)
+              << " chunks/s  decode " << std::setw(9) << per_second(decode_time) << " chunks/s"
+              << (is_equal ? "" : "  MISMATCH") << '\n';
+
+    return is_equal;
+}
+
+}  // namespace
+
+int
+main() {
+    const char* threads = getenv("HDF5_FILTER_THREADS");
+    const auto& cpu = jpegls::cpuBudget();
+    std::cout << "CharLS " << charls_get_version_string() << '\n';
+    std::cout << "CPUs: " << cpu.cpus << " (affinity " << cpu.affinity << ", quota "
+              << (cpu.quota > 0 ? std::to_string(cpu.quota) : "none") << ")\n";
+    std::cout << "HDF5_FILTER_THREADS=" << (threads ? threads : "(default)") << '\n';
+
+    const workload_t workloads[] = {
+        {"u16 2048x2048 chunk", 2048, 2048, 2, 8},
+        {"u16 2048x2048 +crc32c", 2048, 2048, 2, 8, 1},
+        {"u16 2048x2048 uniform", 2048, 2048, 2, 8, jpegls::OPTION_FILL, 0, 0, true},
+        {"u16 512x64 chunk", 512, 64, 2, 200},
+        {"u16 256x8 chunk", 256, 8, 2, 2000},
+        {"u16 256x8 x1 thread", 256, 8, 2, 2000, 0, 1, 1},
+        {"u8 1024x1024 chunk", 1024, 1024, 1, 16},
+    };
+
+    bool ok = true;
+    for (const auto& w : workloads) {
+        ok &= run(w);
+    }
+
+    const char* inline_bytes = getenv("HDF5_FILTER_INLINE_BYTES");
+    std::cout << "\nSmall chunks, HDF5_FILTER_INLINE_BYTES="
+              << (inline_bytes ? inline_bytes : "(default)") << '\n';
+    ok &= runSmall("u16 1024x1 row", 1024, 1, 20000);
+    ok &= runSmall("u16 256x8 chunk", 256, 8, 20000);
+    ok &= runSmall("u16 128x128 chunk", 128, 128, 2000);
+
+    std::cout << "\nu16 512x128 decode latency next to u16 2048x2048 bulk encodes\n";
+    ok &= runMixed("throughput lane", jpegls::PRIORITY_THROUGHPUT, false);
+    ok &= runMixed("latency lane", jpegls::PRIORITY_LATENCY, false);
+
+    std::cout << "\nu16 512x128 decode latency next to u16 2048x2048 bulk decodes\n";
+    ok &= runMixed("throughput lane", jpegls::PRIORITY_THROUGHPUT, true);
+    ok &= runMixed("latency lane", jpegls::PRIORITY_LATENCY, true);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "charls/charls.h"
+#include "cpu-quota.h"
+#include "jpegls-filter.h"
+#include "synthetic.h"
+
+namespace {
+
+using synthetic::clock_type;
+
+/** Throughput of one hot path, taken as the median of several runs. */
+struct metric_t {
+    const char* name;
+    size_t bytes = 0;
+    std::vector<clock_type::duration> samples;
+
+    double mbps() {
+        std::sort(samples.begin(), samples.end());
+        return synthetic::toMBps(bytes, samples[samples.size() / 2]);
+    }
+};
+
+double
+peakRssMB() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+constexpr size_t repeats = 7;
+
+/** jpegls::encode, as used by the direct chunk write path. */
+bool
+libraryEncode(std::vector<metric_t>& metrics) {
+    constexpr size_t width = 2048;
+    constexpr size_t height = 2048;
+    const auto raw = synthetic::makeFrame(width, height, sizeof(uint16_t));
+    const jpegls::subchunk_config_t config(width, height, sizeof(uint16_t));
+
+    metric_t encode{"encode_mbps", raw.size()};
+    for (size_t i = 0; i < repeats; i++) {
+        auto* buf = static_cast<uint8_t*>(malloc(raw.size()));
+        memcpy(buf, raw.data(), raw.size());
+
+        const auto start = clock_type::now();
+        const auto encoded = jpegls::encode({buf, raw.size()}, config);
+        encode.samples.push_back(clock_type::now() - start);
+
+        if (encoded.data == nullptr) {
+            free(buf);
+            return false;
+        }
+        free(encoded.data);
+    }
+
+    metrics.push_back(encode);
+    return true;
+}
+
+/** Large chunks through the plugin entry point and the thread pool. */
+bool
+pluginRoundtrip(std::vector<metric_t>& metrics) {
+    constexpr unsigned int width = 2048;
+    constexpr unsigned int height = 2048;
+    const std::vector<unsigned int> cd_values{width, height, sizeof(uint16_t), 0};
+    const auto raw = synthetic::makeFrame(width, height, sizeof(uint16_t));
+
+    metric_t encode{"encode_mbps", raw.size()};
+    metric_t decode{"decode_mbps", raw.size()};
+    bool is_equal = true;
+    for (size_t i = 0; i < repeats; i++) {
+        encode.samples.emplace_back();
+        const auto encoded = synthetic::runFilter(0, cd_values, raw, encode.samples.back());
+
+        decode.samples.emplace_back();
+        is_equal &= synthetic::runFilter(H5Z_FLAG_REVERSE, cd_values, encoded,
+                                         decode.samples.back()) == raw;
+    }
+
+    metrics.push_back(encode);
+    metrics.push_back(decode);
+    return is_equal;
+}
+
+/** Uniform chunks, which take the fill token path. */
+bool
+pluginUniform(std::vector<metric_t>& metrics) {
+    constexpr unsigned int width = 2048;
+    constexpr unsigned int height = 2048;
+    const std::vector<unsigned int> cd_values{width, height, sizeof(uint16_t), 0,
+                                              jpegls::OPTION_FILL};
+    const auto raw = synthetic::makeUniformFrame(width, height, sizeof(uint16_t));
+
+    metric_t encode{"encode_mbps", raw.size()};
+    metric_t decode{"decode_mbps", raw.size()};
+    bool is_equal = true;
+    for (size_t i = 0; i < repeats; i++) {
+        encode.samples.emplace_back();
+        const auto encoded = synthetic::runFilter(0, cd_values, raw, encode.samples.back());
+
+        decode.samples.emplace_back();
+        is_equal &= synthetic::runFilter(H5Z_FLAG_REVERSE, cd_values, encoded,
+                                         decode.samples.back()) == raw;
+    }
+
+    metrics.push_back(encode);
+    metrics.push_back(decode);
+    return is_equal;
+}
+
+/** Many small chunks, where the fixed cost per filter call dominates. */
+bool
+pluginSmallChunks(std::vector<metric_t>& metrics) {
+    constexpr unsigned int width = 256;
+    constexpr unsigned int height = 8;
+    constexpr size_t batch = 2000;
+    const std::vector<unsigned int> cd_values{width, height, sizeof(uint16_t), 0};
+    const auto raw = synthetic::makeFrame(width, height, sizeof(uint16_t));
+
+    metric_t encode{"encode_mbps", raw.size() * batch};
+    metric_t decode{"decode_mbps", raw.size() * batch};
+    bool is_equal = true;
+    for (size_t i = 0; i < repeats; i++) {
+        std::vector<uint8_t> encoded;
+        encode.samples.emplace_back();
+        for (size_t j = 0; j < batch; j++) {
+            encoded = synthetic::runFilter(0, cd_values, raw, encode.samples.back());
+        }
+
+        decode.samples.emplace_back();
+        for (size_t j = 0; j < batch; j++) {
+            is_equal &= synthetic::runFilter(H5Z_FLAG_REVERSE, cd_values, encoded,
+                                             decode.samples.back()) == raw;
+        }
+    }
+
+    metrics.push_back(encode);
+    metrics.push_back(decode);
+    return is_equal;
+}
+
+struct workload_t {
+    const char* name;
+    std::function<bool(std::vector<metric_t>&)> run;
+};
+
+const workload_t workloads[] = {
+    {"library-encode", libraryEncode},
+    {"plugin-roundtrip", pluginRoundtrip},
+    {"plugin-uniform", pluginUniform},
+    {"plugin-small-chunks", pluginSmallChunks},
+};
+
+}  // namespace
+
+/** Run one fixed workload and print its metrics as a JSON object, for
+ * check-perf.py to compare against the stored baseline. Each workload runs in
+ * its own process, so that the peak RSS belongs to that workload alone.
+ */
+int
+main(int argc, char* argv[]) {
+    const std::string name = (argc > 1) ? argv[1] : "";
+    const auto workload =
+        std::find_if(std::begin(workloads), std::end(workloads),
+                     [&](const workload_t& w) { return name == w.name; });
+
+    if (workload == std::end(workloads)) {
+        std::cerr << "Usage: perf-gate <workload>\n\nWorkloads:\n";
+        for (const auto& w : workloads) {
+            std::cerr << "  " << w.name << '\n';
+        }
+        return 1;
+    }
+
+    std::vector<metric_t> metrics;
+    if (!workload->run(metrics)) {
+        std::cerr << "Error: decoded data differs from the input.\n";
+        return 1;
+    }
+
+    // Codec and pool sizing on this machine, for context; only the last line
+    // is parsed.
+    std::cout << "charls " << charls_get_version_string() << '\n';
+    const auto& cpu = jpegls::cpuBudget();
+    std::cout << "cpus " << cpu.cpus << ", affinity " << cpu.affinity << ", quota " << cpu.quota
+              << '\n';
+
+    std::cout << "{\"workload\": \"" << workload->name << '"';
+    for (auto& m : metrics) {
+        std::cout << ", \"" << m.name << "\": " << m.mbps();
+    }
+    std::cout << ", \"peak_rss_mb\": " << peakRssMB() << "}\n";
+
+    return 0;
+}
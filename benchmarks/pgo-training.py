@@ -0,0 +1,21 @@
+#!/usr/bin/env python3
+"""Run each perf-gate workload once, to record the profile of a build
+configured with -Db_pgo=generate.
+"""
+import argparse
+import subprocess
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('perf_gate', help='path to the perf-gate executable')
+    parser.add_argument('workloads', nargs='+', help='workload names')
+    args = parser.parse_args()
+
+    for workload in args.workloads:
+        print('Training on', workload, flush=True)
+        subprocess.run([args.perf_gate, workload], check=True, stdout=subprocess.DEVNULL)
+
+
+if __name__ == '__main__':
+    main()
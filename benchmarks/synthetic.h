@@ -0,0 +1,88 @@
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <hdf5.h>
+
+#include "h5jpegls.h"
+
+namespace synthetic {
+
+using clock_type = std::chrono::steady_clock;
+
+/** Synthetic detector frame: a smooth gradient with a little noise, so that
+ * the codec sees realistic, compressible data. */
+inline std::vector<uint8_t>
+makeFrame(size_t width, size_t height, size_t typesize) {
+    std::vector<uint8_t> raw(width * height * typesize);
+    uint32_t seed = 12345;
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            seed = seed * 1664525 + 1013904223;
+            const auto noise = (seed >> 28);
+            const auto value = uint32_t(64 * std::sin(x * 0.01) + 64 * std::cos(y * 0.02) + 256) +
+                               noise;
+
+            const size_t i = (y * width + x) * typesize;
+            raw[i] = value & 0xff;
+            if (typesize == 2) {
+                raw[i + 1] = (value >> 8) & 0x0f;
+            }
+        }
+    }
+    return raw;
+}
+
+/** Frame of ones, like test-vector/bloated.hdf5. */
+inline std::vector<uint8_t>
+makeUniformFrame(size_t width, size_t height, size_t typesize) {
+    std::vector<uint8_t> raw(width * height * typesize, 0);
+    for (size_t i = 0; i < raw.size(); i += typesize) {
+        raw[i] = 1;
+    }
+    return raw;
+}
+
+inline double
+toMBps(size_t bytes, clock_type::duration elapsed) {
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    return bytes / seconds / 1e6;
+}
+
+/** Pass a malloc'ed copy of the input through the plugin, as HDF5 does, and
+ * add the time spent in the filter to elapsed.
+ * @return the filter output, empty on failure.
+ */
+inline std::vector<uint8_t>
+runFilter(unsigned int flags, const std::vector<unsigned int>& cd_values,
+          const std::vector<uint8_t>& in, clock_type::duration& elapsed) {
+    size_t buf_size = in.size();
+    void* buf = malloc(buf_size);
+    memcpy(buf, in.data(), in.size());
+
+    const auto start = clock_type::now();
+    const size_t nbytes =
+        codec_filter(flags, cd_values.size(), cd_values.data(), in.size(), &buf_size, &buf);
+    elapsed += clock_type::now() - start;
+
+    std::vector<uint8_t> out;
+    if (nbytes != 0 && nbytes != size_t(-1)) {
+        out.assign(static_cast<uint8_t*>(buf), static_cast<uint8_t*>(buf) + nbytes);
+    }
+    free(buf);
+    return out;
+}
+
+/** runFilter, untimed. */
+inline std::vector<uint8_t>
+runFilter(unsigned int flags, const std::vector<unsigned int>& cd_values,
+          const std::vector<uint8_t>& in) {
+    clock_type::duration elapsed{};
+    return runFilter(flags, cd_values, in, elapsed);
+}
+
+}  // namespace synthetic
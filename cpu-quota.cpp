@@ -0,0 +1,140 @@
+#include "cpu-quota.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace {
+
+size_t
+affinityCpus() {
+    // CPU_ALLOC sets grow until they cover the kernel's CPU count.
+    for (int ncpus = 1024; ncpus <= (1 << 20); ncpus *= 2) {
+        cpu_set_t* set = CPU_ALLOC(ncpus);
+        const size_t size = CPU_ALLOC_SIZE(ncpus);
+        CPU_ZERO_S(size, set);
+
+        const int r = sched_getaffinity(0, size, set);
+        const int count = CPU_COUNT_S(size, set);
+        CPU_FREE(set);
+
+        if (r == 0) {
+            return std::max(count, 1);
+        }
+        if (errno != EINVAL) {
+            break;
+        }
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+/** Quota of one cgroup directory in CPUs, or 0 if there is none. */
+double
+cgroupQuota(const std::string& dir) {
+    // cgroup v2: "<quota> <period>", or "max <period>".
+    std::ifstream cpu_max(dir + "/cpu.max");
+    if (cpu_max) {
+        std::string quota;
+        double period = 0;
+        if (cpu_max >> quota >> period && quota != "max" && period > 0) {
+            return std::stod(quota) / period;
+        }
+        return 0;
+    }
+
+    // cgroup v1: quota is -1 if unlimited.
+    std::ifstream cfs_quota(dir + "/cpu.cfs_quota_us");
+    std::ifstream cfs_period(dir + "/cpu.cfs_period_us");
+    double quota = 0;
+    double period = 0;
+    if (cfs_quota >> quota && cfs_period >> period && quota > 0 && period > 0) {
+        return quota / period;
+    }
+    return 0;
+}
+
+/** Smallest quota of the cgroup of this process and its ancestors, up to the
+ * root of the hierarchy mounted at mount. */
+double
+hierarchyQuota(const std::string& mount, std::string path) {
+    double quota = 0;
+    while (true) {
+        const double q = cgroupQuota(mount + path);
+        if (q > 0 && (quota == 0 || q < quota)) {
+            quota = q;
+        }
+        if (path.empty() || path == "/") {
+            return quota;
+        }
+        path.erase(path.find_last_of('/'));
+    }
+}
+
+double
+quotaCpus() {
+    std::ifstream cgroup("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroup, line)) {
+        // "<id>:<controllers>:<path>"; v2 has id 0 and no controllers.
+        const auto first = line.find(':');
+        const auto second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) {
+            continue;
+        }
+        const std::string controllers = line.substr(first + 1, second - first - 1);
+        const std::string path = line.substr(second + 1);
+
+        if (controllers.empty()) {
+            const double quota = hierarchyQuota("/sys/fs/cgroup", path);
+            if (quota > 0) {
+                return quota;
+            }
+            continue;
+        }
+
+        std::istringstream list(controllers);
+        std::string controller;
+        while (std::getline(list, controller, ',')) {
+            if (controller != "cpu") {
+                continue;
+            }
+            // Inside a container the path is that of the host, and the
+            // container's own cgroup is mounted as the root.
+            for (const char* mount : {"/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu"}) {
+                const double quota = hierarchyQuota(mount, path);
+                if (quota > 0) {
+                    return quota;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+}  // namespace
+
+namespace jpegls {
+
+const cpu_budget_t&
+cpuBudget() {
+    static const cpu_budget_t budget = [] {
+        cpu_budget_t b;
+        b.affinity = affinityCpus();
+        b.quota = quotaCpus();
+        b.cpus = b.affinity;
+        if (b.quota > 0) {
+            b.cpus = std::min(b.cpus, static_cast<size_t>(std::ceil(b.quota)));
+        }
+        b.cpus = std::max<size_t>(b.cpus, 1);
+        return b;
+    }();
+    return budget;
+}
+
+}  // namespace jpegls
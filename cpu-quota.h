@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+
+namespace jpegls {
+
+/** The share of the machine this process may use. Containers and batch jobs
+ * restrict it with a cpuset, i.e. the affinity mask, and with a CFS bandwidth
+ * quota, neither of which std::thread::hardware_concurrency() reports.
+ */
+struct cpu_budget_t {
+    /** CPUs in the affinity mask. */
+    std::size_t affinity = 1;
+
+    /** cgroup CPU quota in CPUs, e.g. 2.5, or 0 if unlimited. */
+    double quota = 0;
+
+    /** Threads worth running: min(affinity, quota rounded up), at least 1. */
+    std::size_t cpus = 1;
+};
+
+/** Read sched_getaffinity() and the cgroup v2 cpu.max or v1 cpu.cfs_quota_us
+ * limits of this process and its parent cgroups, once.
+ */
+const cpu_budget_t&
+cpuBudget();
+
+/** Default number of codec threads. */
+inline std::size_t
+availableCpus() {
+    return cpuBudget().cpus;
+}
+
+}  // namespace jpegls
@@ -0,0 +1,110 @@
+#include "crc32c.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+namespace {
+
+using crc32c_func_t = uint32_t (*)(uint32_t, const uint8_t*, size_t);
+
+/** Reversed Castagnoli polynomial. */
+constexpr uint32_t polynomial = 0x82F63B78;
+
+constexpr std::array<uint32_t, 256>
+makeTable() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr auto lookup_table = makeTable();
+
+uint32_t
+crc32cTable(uint32_t crc, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        crc = lookup_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t
+crc32cHardware(uint32_t crc, const uint8_t* data, size_t size) {
+    uint64_t crc64 = crc;
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = static_cast<uint32_t>(crc64);
+    for (; size > 0; size--, data++) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+crc32c_func_t
+selectImplementation() {
+    return __builtin_cpu_supports("sse4.2") ? crc32cHardware : crc32cTable;
+}
+
+#elif defined(__aarch64__)
+__attribute__((target("+crc"))) uint32_t
+crc32cHardware(uint32_t crc, const uint8_t* data, size_t size) {
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+
+    for (; size > 0; size--, data++) {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+
+crc32c_func_t
+selectImplementation() {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) ? crc32cHardware : crc32cTable;
+}
+
+#else
+crc32c_func_t
+selectImplementation() {
+    return crc32cTable;
+}
+#endif
+
+}  // namespace
+
+namespace jpegls {
+
+uint32_t
+crc32c(const uint8_t* data, size_t size) {
+    static const crc32c_func_t implementation = selectImplementation();
+    return ~implementation(~uint32_t(0), data, size);
+}
+
+uint32_t
+crc32cPortable(const uint8_t* data, size_t size) {
+    return ~crc32cTable(~uint32_t(0), data, size);
+}
+
+}  // namespace jpegls
@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace jpegls {
+
+/** CRC-32C (Castagnoli) checksum of a byte range. Uses the SSE4.2 or ARMv8
+ * CRC32 instructions when the CPU has them, and a lookup table otherwise.
+ */
+uint32_t
+crc32c(const uint8_t* data, std::size_t size);
+
+/** The same checksum from the lookup table alone, whatever the CPU, to test
+ * the hardware implementation against. */
+uint32_t
+crc32cPortable(const uint8_t* data, std::size_t size);
+
+}  // namespace jpegls
@@ -121,8 +121,12 @@ main() {
 
     auto write_task = taskflow
                           .emplace([&]() {
-                              const auto status = writeChunk(
-                                  dset, {0, 0}, std::move(std::get<jpegls::byte_array_t>(encoded)));
+                              auto& chunk = std::get<jpegls::byte_array_t>(encoded);
+                              if (chunk.empty()) {
+                                  std::cerr << "Error: JPEG-LS encoding failed\n";
+                                  return;
+                              }
+                              const auto status = writeChunk(dset, {0, 0}, std::move(chunk));
                               if (status < 0) {
                                   std::cerr << "Error: " << status << '\n';
                               }
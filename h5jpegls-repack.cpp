@@ -0,0 +1,553 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <H5PLextern.h>
+#include <hdf5.h>
+
+#if H5_VERSION_LE(1, 10, 2)
+#include <hdf5_hl.h>
+#endif
+
+
+#include "cpu-quota.h"
+#include "h5jpegls.h"
+#include "jpegls-filter.h"
+#include "threadpool.h"
+
+// The repack tool links the plugin directly, and borrows its thread pool
+// for decoding source chunks that are already JPEG-LS coded.
+
+namespace {
+
+/** Largest chunk, in bytes, that contiguous and compact datasets are split
+ * into. */
+constexpr hsize_t max_synthesized_chunk = hsize_t{64} << 20;
+
+/** How to obtain the uncompressed chunk from the source dataset. */
+enum class source_t {
+    /** Unfiltered: H5Dread_chunk returns the raw bytes. */
+    RAW,
+    /** JPEG-LS only: H5Dread_chunk, then decode in the worker threads. */
+    JPEGLS,
+    /** Any other filter pipeline: let HDF5 decode it with H5Dread. */
+    PIPELINE,
+};
+
+struct options_t {
+    /** Number of chunks encoded concurrently. */
+    size_t jobs = jpegls::availableCpus();
+
+    /** Number of chunks in flight between the reader and the writer. */
+    size_t window = 0;
+
+    /** Filter options, e.g. jpegls::OPTION_CRC32C. */
+    unsigned int filter_options = 0;
+
+    /** Print the per-dataset summary. */
+    bool verbose = false;
+
+    const char* input = nullptr;
+    const char* output = nullptr;
+};
+
+struct context_t {
+    const options_t& options;
+    ThreadPool& pool;
+    hid_t src_file;
+    hid_t dst_file;
+    bool ok = true;
+};
+
+/** One chunk travelling through the read -> encode -> write pipeline. */
+struct chunk_t {
+    std::vector<hsize_t> offset;
+    jpegls::span<uint8_t> encoded;
+    size_t raw_bytes = 0;
+    bool ok = true;
+};
+
+template <typename... Args>
+bool
+fail(Args&&... args) {
+    (std::cerr << "h5jpegls-repack: " << ... << args) << '\n';
+    return false;
+}
+
+herr_t
+copyAttribute(hid_t src, const char* name, const H5A_info_t*, void* op_data) {
+    const hid_t dst = *static_cast<hid_t*>(op_data);
+
+    const hid_t attr = H5Aopen(src, name, H5P_DEFAULT);
+    const hid_t type = H5Aget_type(attr);
+    const hid_t space = H5Aget_space(attr);
+
+    const auto npoints = H5Sget_simple_extent_npoints(space);
+    std::vector<uint8_t> buffer(std::max<size_t>(1, H5Tget_size(type) * npoints));
+
+    herr_t status = H5Aread(attr, type, buffer.data());
+    if (status >= 0) {
+        const hid_t copy = H5Acreate2(dst, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+        status = (copy < 0) ? -1 : H5Awrite(copy, type, buffer.data());
+        H5Aclose(copy);
+
+        if (H5Tdetect_class(type, H5T_VLEN) > 0 || H5Tis_variable_str(type) > 0) {
+#if H5_VERSION_GE(1, 12, 0)
+            H5Treclaim(type, space, H5P_DEFAULT, buffer.data());
+#else
+            H5Dvlen_reclaim(type, space, H5P_DEFAULT, buffer.data());
+#endif
+        }
+    }
+
+    H5Sclose(space);
+    H5Tclose(type);
+    H5Aclose(attr);
+    return status;
+}
+
+bool
+copyAttributes(hid_t src, hid_t dst) {
+    return H5Aiterate2(src, H5_INDEX_NAME, H5_ITER_INC, nullptr, copyAttribute, &dst) >= 0;
+}
+
+/** JPEG-LS codes 2 to 16 bits per sample. */
+bool
+isEligible(hid_t dset) {
+    const hid_t type = H5Dget_type(dset);
+    const hid_t space = H5Dget_space(dset);
+
+    const bool eligible = H5Tget_class(type) == H5T_INTEGER &&
+                          (H5Tget_size(type) == 1 || H5Tget_size(type) == 2) &&
+                          H5Sget_simple_extent_ndims(space) >= 1 &&
+                          H5Sget_simple_extent_npoints(space) > 0;
+
+    H5Sclose(space);
+    H5Tclose(type);
+    return eligible;
+}
+
+std::vector<unsigned int>
+getFilterParams(hid_t dcpl, H5Z_filter_t filter) {
+    unsigned int flags;
+    std::vector<unsigned int> values(16);
+    size_t nelements = values.size();
+    if (H5Pget_filter_by_id2(dcpl, filter, &flags, &nelements, values.data(), 0, nullptr,
+                             nullptr) < 0) {
+        return {};
+    }
+    values.resize(nelements);
+    return values;
+}
+
+source_t
+sourceKind(hid_t dcpl) {
+    if (H5Pget_layout(dcpl) != H5D_CHUNKED) {
+        return source_t::PIPELINE;
+    }
+
+    const int nfilters = H5Pget_nfilters(dcpl);
+    if (nfilters == 0) {
+        return source_t::RAW;
+    }
+
+    unsigned int flags;
+    size_t nelements = 0;
+    if (nfilters == 1 &&
+        H5Pget_filter2(dcpl, 0, &flags, &nelements, nullptr, 0, nullptr, nullptr) ==
+            H5Z_FILTER_JPEGLS) {
+        return source_t::JPEGLS;
+    }
+
+    return source_t::PIPELINE;
+}
+
+/** Read one whole chunk, uncompressed, into a malloc'ed buffer of raw_bytes.
+ * Only the HDF5 calls happen here; JPEG-LS decoding is left to the workers.
+ */
+bool
+readChunk(hid_t src, source_t kind, const std::vector<hsize_t>& offset,
+          const std::vector<hsize_t>& dims, const std::vector<hsize_t>& chunk_dims, hid_t type,
+          size_t raw_bytes, void** buf, size_t* nbytes, bool* filtered) {
+    const auto rank = static_cast<int>(dims.size());
+    *filtered = false;
+
+    if (kind != source_t::PIPELINE) {
+        hsize_t storage_size = 0;
+        if (H5Dget_chunk_storage_size(src, offset.data(), &storage_size) < 0) {
+            return false;
+        }
+
+        *buf = malloc(std::max<size_t>(storage_size, raw_bytes));
+        uint32_t filter_mask = 0;
+#if H5_VERSION_LE(1, 10, 2)
+        const herr_t status = H5DOread_chunk(src, H5P_DEFAULT, offset.data(), &filter_mask, *buf);
+#else
+        const herr_t status = H5Dread_chunk(src, H5P_DEFAULT, offset.data(), &filter_mask, *buf);
+#endif
+        *nbytes = storage_size;
+        *filtered = (kind == source_t::JPEGLS) && (filter_mask & 1) == 0;
+        return status >= 0;
+    }
+
+    // Edge chunks are partially covered by the dataspace. Read the covered
+    // part into the top-left corner of a zero-filled chunk buffer.
+    std::vector<hsize_t> count(rank);
+    for (int i = 0; i < rank; i++) {
+        count[i] = std::min(chunk_dims[i], dims[i] - offset[i]);
+    }
+
+    *buf = calloc(raw_bytes, 1);
+    *nbytes = raw_bytes;
+
+    const std::vector<hsize_t> origin(rank, 0);
+    const hid_t mem_space = H5Screate_simple(rank, chunk_dims.data(), nullptr);
+    H5Sselect_hyperslab(mem_space, H5S_SELECT_SET, origin.data(), nullptr, count.data(), nullptr);
+
+    const hid_t file_space = H5Dget_space(src);
+    H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset.data(), nullptr, count.data(), nullptr);
+
+    const herr_t status = H5Dread(src, type, mem_space, file_space, H5P_DEFAULT, *buf);
+
+    H5Sclose(file_space);
+    H5Sclose(mem_space);
+    return status >= 0;
+}
+
+bool
+writeChunk(hid_t dst, const chunk_t& chunk) {
+    constexpr uint32_t filter_mask = 0;
+#if H5_VERSION_LE(1, 10, 2)
+    return H5DOwrite_chunk(dst, H5P_DEFAULT, filter_mask, chunk.offset.data(),
+                           chunk.encoded.size, chunk.encoded.data) >= 0;
+#else
+    return H5Dwrite_chunk(dst, H5P_DEFAULT, filter_mask, chunk.offset.data(), chunk.encoded.size,
+                          chunk.encoded.data) >= 0;
+#endif
+}
+
+/** Recompress one dataset. The main thread reads chunk i + window while the
+ * workers encode the chunks in between, and chunks are written back in
+ * order as soon as the oldest one is done. */
+bool
+repackDataset(context_t& ctx, const char* name) {
+    const hid_t src = H5Dopen2(ctx.src_file, name, H5P_DEFAULT);
+    const hid_t type = H5Dget_type(src);
+    const hid_t space = H5Dget_space(src);
+    const hid_t src_dcpl = H5Dget_create_plist(src);
+
+    const int rank = H5Sget_simple_extent_ndims(space);
+    std::vector<hsize_t> dims(rank);
+    std::vector<hsize_t> chunk_dims(rank);
+    H5Sget_simple_extent_dims(space, dims.data(), nullptr);
+
+    // Like h5repack, contiguous and compact datasets are chunked on the way.
+    // Here, one chunk per 2-D frame, split into bands, then into shorter rows,
+    // while it is larger than max_synthesized_chunk; HDF5 refuses chunks of
+    // 4 GiB and more, e.g. a whole large rank-1 dataset.
+    const bool is_chunked = H5Pget_layout(src_dcpl) == H5D_CHUNKED;
+    if (is_chunked) {
+        H5Pget_chunk(src_dcpl, rank, chunk_dims.data());
+    } else {
+        std::fill(chunk_dims.begin(), chunk_dims.end(), 1);
+        std::copy(dims.end() - std::min(rank, 2), dims.end(),
+                  chunk_dims.end() - std::min(rank, 2));
+        const hsize_t max_elements = max_synthesized_chunk / H5Tget_size(type);
+        for (int i = std::max(rank - 2, 0); i < rank; i++) {
+            const hsize_t others = std::accumulate(chunk_dims.begin(), chunk_dims.end(),
+                                                   hsize_t{1}, std::multiplies<hsize_t>()) /
+                                   chunk_dims[i];
+            chunk_dims[i] = std::max<hsize_t>(1, std::min(chunk_dims[i], max_elements / others));
+        }
+    }
+
+    const source_t kind = sourceKind(src_dcpl);
+    const auto src_params = (kind == source_t::JPEGLS)
+                                ? getFilterParams(src_dcpl, H5Z_FILTER_JPEGLS)
+                                : std::vector<unsigned int>{};
+
+    // Same creation properties, e.g. fill value and chunk shape, with the
+    // filter pipeline replaced by JPEG-LS.
+    const hid_t dst_dcpl = H5Pcopy(src_dcpl);
+    const unsigned int filter_param[5] = {0, 0, 0, 0, ctx.options.filter_options};
+    if (is_chunked) {
+        H5Premove_filter(dst_dcpl, H5Z_FILTER_ALL);
+    } else {
+        H5Pset_chunk(dst_dcpl, rank, chunk_dims.data());
+    }
+    H5Pset_filter(dst_dcpl, H5Z_FILTER_JPEGLS, H5Z_FLAG_MANDATORY, 5, filter_param);
+
+    const hid_t dst = H5Dcreate2(ctx.dst_file, name, type, space, H5P_DEFAULT, dst_dcpl,
+                                 H5P_DEFAULT);
+    H5Pclose(dst_dcpl);
+
+    if (dst < 0 || !copyAttributes(src, dst)) {
+        H5Pclose(src_dcpl);
+        H5Sclose(space);
+        H5Tclose(type);
+        H5Dclose(src);
+        return fail("cannot create ", name);
+    }
+
+    // Read back the parameters computed by the set_local callback.
+    const auto dst_params = [&]() {
+        const hid_t dcpl = H5Dget_create_plist(dst);
+        auto values = getFilterParams(dcpl, H5Z_FILTER_JPEGLS);
+        H5Pclose(dcpl);
+        return values;
+    }();
+    auto config = jpegls::getParams(dst_params.size(), dst_params.data());
+
+    const size_t raw_bytes =
+        std::accumulate(chunk_dims.begin(), chunk_dims.end(), H5Tget_size(type),
+                        std::multiplies<size_t>());
+
+    // With several chunks in flight, share the CPUs between them, within the
+    // thread cap of the dataset if it has one.
+    const size_t inner_threads =
+        std::max<size_t>(1, jpegls::availableCpus() / ctx.options.jobs);
+    if (config.threads == 0 || config.threads > inner_threads) {
+        config.threads = inner_threads;
+    }
+
+    std::deque<std::future<chunk_t>> inflight;
+    size_t nchunks = 0;
+    size_t compressed_bytes = 0;
+    bool ok = true;
+
+    const auto retire = [&]() {
+        auto chunk = inflight.front().get();
+        inflight.pop_front();
+
+        ok &= chunk.ok && writeChunk(dst, chunk);
+        compressed_bytes += chunk.encoded.size;
+        free(chunk.encoded.data);
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<hsize_t> offset(rank, 0);
+    for (bool done = false; !done && ok;) {
+        hsize_t storage_size = 0;
+        const bool allocated =
+            kind == source_t::PIPELINE ||
+            (H5Dget_chunk_storage_size(src, offset.data(), &storage_size) >= 0 &&
+             storage_size > 0);
+
+        if (allocated) {
+            void* buf = nullptr;
+            size_t nbytes = 0;
+            bool filtered = false;
+            if (!readChunk(src, kind, offset, dims, chunk_dims, type, raw_bytes, &buf, &nbytes,
+                           &filtered)) {
+                free(buf);
+                ok = fail("cannot read a chunk of ", name);
+                break;
+            }
+
+            inflight.emplace_back(ctx.pool.enqueue(
+                [&, buf, nbytes, filtered, offset]() mutable -> chunk_t {
+                    chunk_t chunk{offset, {}, raw_bytes};
+
+                    size_t buf_size = nbytes;
+                    if (filtered &&
+                        codec_filter(H5Z_FLAG_REVERSE, src_params.size(), src_params.data(),
+                                     nbytes, &buf_size, &buf) != raw_bytes) {
+                        chunk.ok = false;
+                        free(buf);
+                        return chunk;
+                    }
+
+                    chunk.encoded = jpegls::encode(
+                        {static_cast<uint8_t*>(buf), raw_bytes}, config);
+                    if (chunk.encoded.data == nullptr) {
+                        chunk.ok = false;
+                        free(buf);
+                    }
+                    return chunk;
+                }));
+            nchunks++;
+
+            if (inflight.size() >= ctx.options.window) {
+                retire();
+            }
+        }
+
+        // Next chunk, in row-major order.
+        done = true;
+        for (int i = rank - 1; i >= 0; i--) {
+            offset[i] += chunk_dims[i];
+            if (offset[i] < dims[i]) {
+                done = false;
+                break;
+            }
+            offset[i] = 0;
+        }
+    }
+
+    while (!inflight.empty()) {
+        retire();
+    }
+
+    if (ctx.options.verbose) {
+        const double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << ": " << nchunks << " chunks, "
+                  << nchunks * raw_bytes / seconds / 1e6 << " MB/s, ratio "
+                  << double(nchunks * raw_bytes) / std::max<size_t>(1, compressed_bytes) << '\n';
+    }
+
+    H5Dclose(dst);
+    H5Pclose(src_dcpl);
+    H5Sclose(space);
+    H5Tclose(type);
+    H5Dclose(src);
+
+    return ok || fail("cannot repack ", name);
+}
+
+template <typename Info>
+herr_t
+visitLink(hid_t src_root, const char* name, const Info* info, void* op_data) {
+    auto& ctx = *static_cast<context_t*>(op_data);
+
+    if (info->type == H5L_TYPE_SOFT) {
+        std::vector<char> target(info->u.val_size + 1);
+        H5Lget_val(src_root, name, target.data(), target.size(), H5P_DEFAULT);
+        ctx.ok &= H5Lcreate_soft(target.data(), ctx.dst_file, name, H5P_DEFAULT, H5P_DEFAULT) >= 0;
+        return ctx.ok ? 0 : -1;
+    }
+
+    if (info->type == H5L_TYPE_EXTERNAL) {
+        std::vector<char> value(info->u.val_size);
+        const char* file_name = nullptr;
+        const char* obj_name = nullptr;
+        ctx.ok &= H5Lget_val(src_root, name, value.data(), value.size(), H5P_DEFAULT) >= 0 &&
+                  H5Lunpack_elink_val(value.data(), value.size(), nullptr, &file_name,
+                                      &obj_name) >= 0 &&
+                  H5Lcreate_external(file_name, obj_name, ctx.dst_file, name, H5P_DEFAULT,
+                                     H5P_DEFAULT) >= 0;
+        return ctx.ok ? 0 : -1;
+    }
+
+    if (info->type != H5L_TYPE_HARD) {
+        std::cerr << "h5jpegls-repack: skipping user-defined link " << name << '\n';
+        return 0;
+    }
+
+    const hid_t obj = H5Oopen(src_root, name, H5P_DEFAULT);
+    const auto obj_type = H5Iget_type(obj);
+
+    if (obj_type == H5I_GROUP) {
+        const hid_t group = H5Gcreate2(ctx.dst_file, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        ctx.ok &= group >= 0 && copyAttributes(obj, group);
+        H5Gclose(group);
+    } else if (obj_type == H5I_DATASET && isEligible(obj)) {
+        ctx.ok &= repackDataset(ctx, name);
+    } else {
+        ctx.ok &= H5Ocopy(src_root, name, ctx.dst_file, name, H5P_DEFAULT, H5P_DEFAULT) >= 0;
+    }
+
+    H5Oclose(obj);
+
+    // Stop at the first error.
+    return ctx.ok ? 0 : -1;
+}
+
+void
+usage() {
+    std::cerr << "Usage: h5jpegls-repack [-j jobs] [-w window] [-c] [-v] input.h5 output.h5\n"
+                 "\n"
+                 "Copy input.h5 to output.h5, recompressing every chunked 8- or 16-bit\n"
+                 "integer dataset with the JPEG-LS filter. Other objects are copied as is.\n"
+                 "\n"
+                 "  -j jobs    chunks encoded concurrently (default: all cores)\n"
+                 "  -w window  chunks in flight between reader and writer (default: 2 x jobs)\n"
+                 "  -c         store a CRC32C checksum of every subchunk\n"
+                 "  -v         print throughput and compression ratio per dataset\n";
+}
+
+}  // namespace
+
+int
+main(int argc, char* argv[]) {
+    options_t options;
+
+    for (int opt; (opt = getopt(argc, argv, "j:w:cvh")) != -1;) {
+        switch (opt) {
+            case 'j':
+                options.jobs = std::max(1, atoi(optarg));
+                break;
+            case 'w':
+                options.window = std::max(1, atoi(optarg));
+                break;
+            case 'c':
+                options.filter_options |= jpegls::OPTION_CRC32C;
+                break;
+            case 'v':
+                options.verbose = true;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+    options.input = argv[optind];
+    options.output = argv[optind + 1];
+    if (options.window == 0) {
+        options.window = 2 * options.jobs;
+    }
+
+    // The plugin is linked in, no need to search HDF5_PLUGIN_PATH.
+    if (H5Zfilter_avail(H5Z_FILTER_JPEGLS) <= 0 &&
+        H5Zregister(H5PLget_plugin_info()) < 0) {
+        fail("cannot register the JPEG-LS filter");
+        return 1;
+    }
+
+    const hid_t src_file = H5Fopen(options.input, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (src_file < 0) {
+        fail("cannot open ", options.input);
+        return 1;
+    }
+
+    const hid_t dst_file = H5Fcreate(options.output, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (dst_file < 0) {
+        H5Fclose(src_file);
+        fail("cannot create ", options.output);
+        return 1;
+    }
+
+    ThreadPool pool(options.jobs);
+    context_t ctx{options, pool, src_file, dst_file};
+
+    {
+        const hid_t src_root = H5Gopen2(src_file, "/", H5P_DEFAULT);
+        const hid_t dst_root = H5Gopen2(dst_file, "/", H5P_DEFAULT);
+        ctx.ok &= copyAttributes(src_root, dst_root);
+        H5Gclose(dst_root);
+
+        ctx.ok &= H5Lvisit(src_root, H5_INDEX_NAME, H5_ITER_INC, visitLink, &ctx) >= 0;
+        H5Gclose(src_root);
+    }
+
+    H5Fclose(dst_file);
+    H5Fclose(src_file);
+
+    return ctx.ok ? 0 : 1;
+}
@@ -1,6 +1,8 @@
 #include <malloc.h>
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
@@ -8,6 +10,7 @@
 #include <tuple>
 #include <vector>
 
+#include <pthread.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
@@ -15,37 +18,215 @@
 #include <H5Zpublic.h>
 #include <hdf5.h>
 
+#include "h5jpegls.h"
 #include "jpegls-filter.h"
 
 #include "charls/charls.h"
+#include "cpu-quota.h"
+#include "crc32c.h"
 #include "threadpool.h"
 ThreadPool* filter_pool = nullptr;
 
-#include <future>
-
 using std::vector;
 
 #define VISIBLE __attribute__ ((visibility ("default")))
 
 namespace {
 
-// Temporary unofficial filter ID
-const H5Z_filter_t H5Z_FILTER_JPEGLS = 32012;
+using jpegls::getParams;
+using jpegls::INVALID;
+
+std::mutex filter_pool_mutex;
+
+/* The pool is created by the first chunk rather than at load time, so that
+ * applications which only open the library start no threads. */
+ThreadPool*
+getThreadPool() {
+    std::lock_guard<std::mutex> lock(filter_pool_mutex);
+    if (filter_pool != nullptr) {
+        return filter_pool;
+    }
+
+    int threads = 0;
+    char* envvar = getenv("HDF5_FILTER_THREADS");
+    if (envvar != nullptr) {
+        threads = atoi(envvar);
+    }
+    if (threads <= 0) {
+        threads = jpegls::availableCpus();
+    }
+
+    int idle_ms = 5000;
+    envvar = getenv("HDF5_FILTER_IDLE_MS");
+    if (envvar != nullptr) {
+        idle_ms = std::max(atoi(envvar), 0);
+    }
+
+    // Only for benchmarks: 0 leaves the decode to the workers while the
+    // calling thread waits.
+    envvar = getenv("HDF5_FILTER_CALLER_RUNS");
+    const bool caller_runs = envvar == nullptr || atoi(envvar) != 0;
+
+    if (getenv("HDF5_FILTER_VERBOSE") != nullptr) {
+        const auto& cpu = jpegls::cpuBudget();
+        fprintf(stderr, "h5jpegls: %zu CPUs (affinity %zu, quota %.2f), %d pool threads\n",
+                cpu.cpus, cpu.affinity, cpu.quota, threads);
+    }
+
+    filter_pool = new ThreadPool(threads, std::chrono::milliseconds(idle_ms), caller_runs);
+    return filter_pool;
+}
+
+/* Chunks of up to this many raw bytes are coded on the calling thread, where
+ * the handoff to the pool would cost more than the codec itself. */
+size_t
+inlineChunkBytes() {
+    static const size_t bytes = [] {
+        const char* envvar = getenv("HDF5_FILTER_INLINE_BYTES");
+        return (envvar != nullptr) ? strtoull(envvar, nullptr, 10) : size_t(64) << 10;
+    }();
+    return bytes;
+}
+
+/* Lane override of the calling thread, see h5jpegls_set_priority. */
+thread_local int thread_priority = jpegls::PRIORITY_DATASET;
+
+ThreadPool::lane_t
+laneOf(const jpegls::subchunk_config_t& c) {
+    switch (thread_priority) {
+        case jpegls::PRIORITY_LATENCY:
+            return ThreadPool::lane_t::latency;
+        case jpegls::PRIORITY_THROUGHPUT:
+            return ThreadPool::lane_t::throughput;
+        default:
+            return c.has(jpegls::OPTION_LATENCY) ? ThreadPool::lane_t::latency
+                                                 : ThreadPool::lane_t::throughput;
+    }
+}
+
+/* Byte ranges of one stored, still compressed chunk of a dataset whose only
+ * filter is JPEG-LS. With the sec2 driver they are read from the file
+ * directly; otherwise H5Dread_chunk fetches the whole chunk once. */
+class stored_chunk_t {
+   public:
+    jpegls::subchunk_config_t config{INVALID, 1, 1};
+
+    ~stored_chunk_t() {
+        if (file >= 0) {
+            H5Fclose(file);
+        }
+    }
+
+    /** @return 1 if the chunk is stored JPEG-LS coded, 0 if it is not
+     *          allocated, the filter was skipped, other filters change the
+     *          stored bytes too or the dataset has no usable filter
+     *          parameters, and -1 on error. */
+    int
+    open(hid_t dset_id, const hsize_t* chunk_offset) {
+        dset = dset_id;
+        offset = chunk_offset;
+
+        const hid_t dcpl = H5Dget_create_plist(dset);
+        if (dcpl < 0) {
+            return -1;
+        }
+        unsigned int flags;
+        unsigned int values[9];
+        size_t nelements = 9;
+        const herr_t r = H5Pget_filter_by_id(dcpl, H5Z_FILTER_JPEGLS, &flags, &nelements,
+                                             values, 0, nullptr, nullptr);
+        const int nfilters = H5Pget_nfilters(dcpl);
+        H5Pclose(dcpl);
+        if (r < 0) {
+            return -1;
+        }
+
+        config = getParams(nelements, values);
+        if (!config.isValid() || nfilters != 1) {
+            return 0;
+        }
+
+        unsigned int filter_mask = 0;
+        if (H5Dget_chunk_info_by_coord(dset, offset, &filter_mask, &address, &size) < 0) {
+            return -1;
+        }
+        if (address == HADDR_UNDEF || filter_mask != 0) {
+            return 0;
+        }
+
+        file = H5Iget_file_id(dset);
+        const hid_t fapl = H5Fget_access_plist(file);
+        void* handle = nullptr;
+        if (H5Pget_driver(fapl) == H5FD_SEC2 &&
+            H5Fget_vfd_handle(file, fapl, &handle) >= 0) {
+            fd = *static_cast<int*>(handle);
+        }
+        H5Pclose(fapl);
+        return 1;
+    }
+
+    bool
+    read(size_t position, size_t length, std::vector<uint8_t>& out) {
+        if (position + length > size) {
+            return false;
+        }
+
+        out.resize(length);
+        if (fd >= 0) {
+            return pread(fd, out.data(), length, address + position) ==
+                   static_cast<ssize_t>(length);
+        }
 
-constexpr int INVALID = -1;
+        if (whole.empty()) {
+            whole.resize(size);
+            uint32_t read_mask = 0;
+            if (H5Dread_chunk(dset, H5P_DEFAULT, offset, &read_mask, whole.data()) < 0) {
+                whole.clear();
+                return false;
+            }
+        }
+        std::copy(whole.begin() + position, whole.begin() + position + length, out.begin());
+        return true;
+    }
 
-jpegls::subchunk_config_t
-getParams(const size_t cd_nelmts, const unsigned int cd_values[]) {
-    if (cd_nelmts <= 3 || cd_values[0] == 0) {
-        return {INVALID, 0, 0, 0};
+   private:
+    hid_t dset = -1;
+    const hsize_t* offset = nullptr;
+    hid_t file = -1;
+    int fd = -1;
+    haddr_t address = HADDR_UNDEF;
+    hsize_t size = 0;
+    std::vector<uint8_t> whole;
+};
+
+/* A forked child inherits none of the pool workers of its parent, so it drops
+ * the pool, which the next chunk rebuilds. Encoding runs on the pool too, as
+ * libgomp hangs in the first parallel region of such a child. */
+
+void
+prepareFork() {
+    filter_pool_mutex.lock();
+    if (filter_pool != nullptr) {
+        filter_pool->prepare_fork();
     }
+}
 
-    int length = cd_values[0];
-    size_t nblocks = cd_values[1];
-    int typesize = cd_values[2];
-    int lossy = cd_values[3];
+void
+parentAfterFork() {
+    if (filter_pool != nullptr) {
+        filter_pool->parent_after_fork();
+    }
+    filter_pool_mutex.unlock();
+}
 
-    return {length, nblocks, typesize, lossy};
+void
+childAfterFork() {
+    if (filter_pool != nullptr) {
+        // Leaked on purpose: its destructor would join threads that do not exist here.
+        filter_pool->child_after_fork();
+        filter_pool = nullptr;
+    }
+    filter_pool_mutex.unlock();
 }
 
 }  // namespace
@@ -56,84 +237,142 @@ codec_filter(unsigned int flags, size_t cd_nelmts, const unsigned int cd_values[
              size_t* buf_size, void** buf) {
     const auto config = getParams(cd_nelmts, cd_values);
 
-    if (config.length == INVALID) {
-        std::cerr << "Error: Incorrect number of filter parameters specified. Aborting.\n";
+    if (!config.isValid()) {
+        std::cerr << "Error: Invalid filter parameters specified. Aborting.\n";
         return -1;
     }
 
+    const size_t raw_size = config.nblocks * config.length * config.typesize;
+    const bool inline_chunk = raw_size <= inlineChunkBytes();
+
     if (flags & H5Z_FLAG_REVERSE) {
-        const auto [length, typesize, nblocks, subchunks, lblocks, header_size, remainder, lossy] =
-            config;
+        const auto& c = config;
+
+        if (inline_chunk) {
+            // Decode straight into the output; the input needs no copy.
+            auto* const out = static_cast<unsigned char*>(malloc(raw_size));
+            if (out == nullptr ||
+                !jpegls::decode({static_cast<const uint8_t*>(*buf), nbytes}, c, {out, raw_size})) {
+                free(out);
+                std::cerr << "Error: JPEG-LS chunk is truncated or corrupted.\n";
+                return 0;
+            }
+            free(*buf);
+            *buf = out;
+            *buf_size = raw_size;
+            return raw_size;
+        }
 
-        char err_msg[256];
+        const auto lane = laneOf(c);
 
-        filter_pool->lock_buffers();
-        /* Input */
-        auto in_buf = static_cast<unsigned char*>(realloc(*buf, nblocks * length * typesize * 2));
+        ThreadPool* const pool = getThreadPool();
+        pool->lock_buffers();
+        /* Input. Never shrink below the compressed size, which may exceed the
+         * raw size for tiny, incompressible chunks. */
+        auto in_buf = static_cast<unsigned char*>(realloc(*buf, std::max(nbytes, raw_size)));
         *buf = in_buf;
 
-        uint32_t block_size[subchunks];
-        uint32_t offset[subchunks];
+        std::vector<uint32_t> block_size(c.subchunks);
+        std::vector<uint32_t> checksum(c.subchunks);
+        std::vector<uint32_t> offset(c.subchunks);
         // Extract header
-        memcpy(block_size, in_buf, subchunks * sizeof(uint32_t));
+        memcpy(block_size.data(), in_buf, c.subchunks * sizeof(uint32_t));
+        if (c.has(jpegls::OPTION_CRC32C)) {
+            memcpy(checksum.data(), in_buf + c.subchunks * sizeof(uint32_t),
+                   c.subchunks * sizeof(uint32_t));
+
+        }
+
+        // Never read past the end of a corrupted chunk.
+        const size_t payload_size =
+            std::accumulate(block_size.begin(), block_size.end(), size_t(0));
+        if (nbytes < c.header_size + payload_size) {
+            pool->unlock_buffers();
+            std::cerr << "Error: JPEG-LS chunk is truncated.\n";
+            return 0;
+        }
 
         offset[0] = 0;
         uint32_t coffset = 0;
-        for (size_t block = 1; block < subchunks; block++) {
+        for (size_t block = 1; block < c.subchunks; block++) {
             coffset += block_size[block - 1];
             offset[block] = coffset;
         }
 
-        unsigned char* tbuf[subchunks];
-        vector<std::future<void>> futures;
-        // Make a copy of the compressed buffer. Required because we
-        // now realloc in_buf.
-        for (size_t block = 0; block < subchunks; block++) {
-            futures.emplace_back(filter_pool->enqueue([&, block, config] {
-                const auto [length, typesize, nblocks, subchunks, lblocks, header_size, remainder, _] =
-                    config;
-                tbuf[block] =
-                    filter_pool->get_global_buffer(block, length * nblocks * typesize + 512);
-                memcpy(tbuf[block], in_buf + header_size + offset[block], block_size[block]);
-            }));
+        // Make a copy of the compressed buffer. Required because the decoded
+        // subchunks overwrite in_buf. The scratch buffer is this decode's
+        // alone, so decodes of other chunks run meanwhile. The calling thread
+        // takes part in both passes rather than waiting on the workers.
+        const Worker_buffer scratch = pool->get_global_buffer(payload_size + 512);
+        std::vector<unsigned char*> tbuf(c.subchunks);
+        pool->parallel_for(c.subchunks, [&](const size_t block) {
+            tbuf[block] = scratch.data + offset[block];
+            memcpy(tbuf[block], in_buf + c.header_size + offset[block], block_size[block]);
+        }, c.threads, lane);
+
+        // must complete all copies first, otherwise a decompressor could
+        // overwrite the part of in_buf that is still to be copied.
+        std::atomic<bool> corrupted{false};
+        std::atomic<bool> undecodable{false};
+        pool->parallel_for(c.subchunks, [&](const size_t block) {
+            if (c.has(jpegls::OPTION_CRC32C) &&
+                jpegls::crc32c(tbuf[block], block_size[block]) != checksum[block]) {
+                corrupted = true;
+                return;
+            }
+
+            const size_t row_bytes = c.typesize * c.length;
+            if (!jpegls::decodeSubchunk({tbuf[block], block_size[block]},
+                                        {in_buf + row_bytes * c.rowOffset(block),
+                                         row_bytes * c.rowCount(block)},
+                                        c.typesize)) {
+                undecodable = true;
+            }
+        }, c.threads, lane);
+
+        pool->put_global_buffer(scratch);
+        pool->unlock_buffers();
+
+        if (corrupted) {
+            std::cerr << "Error: JPEG-LS chunk failed the CRC32C check.\n";
+            return 0;
         }
-        // must wait for copies to complete, otherwise having
-        // threads > subchunks could lead to a decompressor overwriting in_buf
-        for (auto& future : futures) {
-            future.wait();
+        if (undecodable) {
+            std::cerr << "Error: JPEG-LS chunk is corrupted.\n";
+            return 0;
         }
 
-        for (size_t block = 0; block < subchunks; block++) {
-            futures.emplace_back(filter_pool->enqueue([&, block, config] {
-                const auto [length, typesize, nblocks, subchunks, lblocks, header_size, remainder, _] =
-                    config;
-                size_t own_blocks = (block < remainder ? 1 : 0) + lblocks;
-                CharlsApiResultType ret = JpegLsDecode(
-                    in_buf + typesize * length *
-                                 ((block < remainder) ? block * (lblocks + 1)
-                                                      : (remainder * (lblocks + 1) +
-                                                         (block - remainder) * lblocks)),
-                    typesize * length * own_blocks, tbuf[block], block_size[block], nullptr,
-                    err_msg);
-                if (ret != CharlsApiResultType::OK) {
-                    fprintf(stderr, "JPEG-LS error %d: %s\n", static_cast<int>(ret), err_msg);
-                }
-            }));
-        }
-        for (auto& future : futures) {
-            future.wait();
-        }
-
-        *buf_size = nblocks * length * typesize;
-
-        filter_pool->unlock_buffers();
+        *buf_size = raw_size;
         return *buf_size;
 
     } else {
         /* Compressing raw data into jpegls-encoding */
 
+        if (inline_chunk) {
+            const auto out_buf =
+                jpegls::encodeSerial({static_cast<const uint8_t*>(*buf), nbytes}, config);
+            // Otherwise the chunk did not fit the size bound; take the pool path.
+            if (out_buf.data != nullptr) {
+                free(*buf);
+                *buf = out_buf.data;
+                *buf_size = out_buf.size;
+                return out_buf.size;
+            }
+        }
+
+        /* Subchunks are encoded on the filter pool rather than an OpenMP
+         * team, so that decodes in the latency lane can overtake them. */
         jpegls::span<uint8_t> raw_data{reinterpret_cast<uint8_t*>(*buf), *buf_size};
-        const auto out_buf = jpegls::encode(raw_data, config);
+        ThreadPool* const pool = getThreadPool();
+        const auto lane = laneOf(config);
+        const auto out_buf = jpegls::encode(
+            raw_data, config, [&](size_t n, const std::function<void(size_t)>& f) {
+                pool->parallel_for(n, f, config.threads, lane);
+            });
+        if (out_buf.data == nullptr) {
+            std::cerr << "Error: JPEG-LS encoding failed.\n";
+            return 0;
+        }
         *buf = out_buf.data;
         *buf_size = out_buf.size;
 
@@ -141,12 +380,65 @@ codec_filter(unsigned int flags, size_t cd_nelmts, const unsigned int cd_values[
     }
 }
 
+VISIBLE
+void
+h5jpegls_set_priority(int priority) {
+    thread_priority = priority;
+}
+
+VISIBLE
+int
+h5jpegls_read_chunk_stats(hid_t dset, const hsize_t* offset,
+                          std::vector<jpegls::subchunk_stats_t>& stats) {
+    stored_chunk_t chunk;
+    const int r = chunk.open(dset, offset);
+    const auto& c = chunk.config;
+    if (r <= 0 || !c.has(jpegls::OPTION_STATS)) {
+        return std::min(r, 0);
+    }
+
+    std::vector<uint8_t> header;
+    if (!chunk.read(0, c.header_size, header)) {
+        return -1;
+    }
+    return jpegls::readStats({header.data(), header.size()}, c, stats) ? 1 : 0;
+}
+
+VISIBLE
+int
+h5jpegls_read_chunk_preview(hid_t dset, const hsize_t* offset, std::vector<uint8_t>& preview,
+                            size_t& rows, size_t& columns) {
+    stored_chunk_t chunk;
+    const int r = chunk.open(dset, offset);
+    const auto& c = chunk.config;
+    if (r <= 0 || !c.has(jpegls::OPTION_PREVIEW)) {
+        return std::min(r, 0);
+    }
+
+    std::vector<uint8_t> encoded;
+    size_t position;
+    size_t size;
+    if (!chunk.read(0, c.header_size, encoded) ||
+        !jpegls::previewExtent({encoded.data(), encoded.size()}, c, position, size) ||
+        !chunk.read(position, size, encoded)) {
+        return -1;
+    }
+
+    rows = c.previewRows();
+    columns = c.previewColumns();
+    preview.resize(rows * columns * c.typesize);
+    return jpegls::decodeSubchunk({encoded.data(), encoded.size()},
+                                  {preview.data(), preview.size()}, c.typesize)
+               ? 1
+               : -1;
+}
+
 VISIBLE
 herr_t h5jpegls_set_local(hid_t dcpl, hid_t type, hid_t) {  // NOLINT
     const auto [r, flags,
                 values] = [&]() -> std::tuple<herr_t, unsigned int, std::vector<unsigned int>> {
         unsigned int flags;
-        std::vector<unsigned int> values(8);
+        std::vector<unsigned int> values(9);
         size_t nelements = values.size();
 
         const auto r = H5Pget_filter_by_id(dcpl, H5Z_FILTER_JPEGLS, &flags, &nelements,
@@ -174,7 +466,24 @@ herr_t h5jpegls_set_local(hid_t dcpl, hid_t type, hid_t) {  // NOLINT
 
     constexpr unsigned int minus_one = -1;
 
-    auto cb_values = [&]() -> const std::array<unsigned int, 4> {
+    // User-defined filter options, e.g. OPTION_CRC32C, and the per-dataset
+    // thread cap pass through as is. The default subchunk count is stored
+    // explicitly, and it does not depend on the CPUs of the writer, so that
+    // direct chunk writers with a default subchunk_config_t agree with it.
+    const unsigned int options = values.size() > 4 ? values[4] : 0;
+    const unsigned int threads = values.size() > 5 ? values[5] : 0;
+    const unsigned int subchunks = (values.size() > 6 && values[6] != 0)
+                                       ? values[6]
+                                       : jpegls::subchunk_config_t::default_subchunks;
+
+    // With OPTION_FRAMES, subchunks follow the frames of (..., frames, rows,
+    // columns) chunks; otherwise the layout stays readable by version 0.2.
+    const unsigned int frame_rows =
+        (ndims >= 3 && (options & jpegls::OPTION_FRAMES)) ? chunkdims[ndims - 2] : 0;
+
+    const unsigned int preview_scale = values.size() > 8 ? values[8] : 0;
+
+    auto cb_values = [&]() -> const std::array<unsigned int, 9> {
         unsigned int length = chunkdims[ndims - 1];
         unsigned int nblocks = (ndims == 1) ? 1 : std::accumulate(
                 chunkdims, chunkdims + ndims - 1, 1, std::multiplies<int>());
@@ -184,26 +493,35 @@ herr_t h5jpegls_set_local(hid_t dcpl, hid_t type, hid_t) {  // NOLINT
             return {minus_one, 0, 0};
         }
 
+        // Signed samples get signed subchunk statistics.
+        bool is_signed = H5Tget_class(type) == H5T_INTEGER && H5Tget_sign(type) == H5T_SGN_2;
+
         H5T_class_t classt = H5Tget_class(type);
         if (classt == H5T_ARRAY) {
             hid_t super_type = H5Tget_super(type);
             typesize = H5Tget_size(super_type);
+            is_signed = H5Tget_class(super_type) == H5T_INTEGER &&
+                        H5Tget_sign(super_type) == H5T_SGN_2;
             H5Tclose(super_type);
         }
 
         if (byte_mode) {
             typesize = 1;
             length *= typesize;
+            is_signed = false;
         }
 
-        return {length, nblocks, typesize};
+        const unsigned int sample_options = is_signed ? (options | jpegls::OPTION_SIGNED)
+                                                      : (options & ~jpegls::OPTION_SIGNED);
+
+        return {length,  nblocks,   typesize,   0,           sample_options,
+                threads, subchunks, frame_rows, preview_scale};
     }();
 
     if (cb_values[0] == minus_one) {
         return -1;
     }
 
-    // nelements = 3; // TODO: update if we accept #subchunks
     {
         const auto r =
             H5Pmodify_filter(dcpl, H5Z_FILTER_JPEGLS, flags, cb_values.size(), cb_values.data());
@@ -222,7 +540,7 @@ const H5Z_class2_t H5Z_JPEGLS[1] = {{
     H5Z_FILTER_JPEGLS,                                     /* Filter id number */
     1,                                                     /* encoder_present flag (set to true) */
     1,                                                     /* decoder_present flag (set to true) */
-    "HDF5 JPEG-LS filter v0.2",                            /* Filter name for debugging */
+    "HDF5 JPEG-LS filter v0.4",                            /* Filter name for debugging */
     nullptr,                                               /* The "can apply" callback     */
     static_cast<H5Z_set_local_func_t>(h5jpegls_set_local), /* The "set local" callback */
     static_cast<H5Z_func_t>(codec_filter),                 /* The actual filter function */
@@ -239,16 +557,8 @@ const void* H5PLget_plugin_info() {  // NOLINT
 }
 
 __attribute__((constructor)) void
-init_threadpool() {
-    int threads = 0;
-    char* envvar = getenv("HDF5_FILTER_THREADS");
-    if (envvar != nullptr) {
-        threads = atoi(envvar);
-    }
-    if (threads <= 0) {
-        threads = std::min(std::thread::hardware_concurrency(), 8u);
-    }
-    filter_pool = new ThreadPool(threads);
+register_fork_handlers() {
+    pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
 }
 
 __attribute__((destructor)) void
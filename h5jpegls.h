@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+#include <hdf5.h>
+
+#include "jpegls-filter.h"
+
+/** Temporary unofficial filter ID */
+constexpr H5Z_filter_t H5Z_FILTER_JPEGLS = 32012;
+
+// Exported by the h5jpegls plugin, for programs that link it directly.
+
+/** The HDF5 filter callback: encodes *buf in place, or decodes it with
+ * H5Z_FLAG_REVERSE in flags.
+ * @return the size of the new *buf, or 0 on error.
+ */
+size_t
+codec_filter(unsigned int flags, size_t cd_nelmts, const unsigned int cd_values[], size_t nbytes,
+             size_t* buf_size, void** buf);
+
+/** Schedule the chunks that the calling thread encodes or decodes from now on
+ * in the latency or throughput lane of the pool, whatever the option bits of
+ * their dataset; jpegls::PRIORITY_DATASET goes back to the option bits. */
+void
+h5jpegls_set_priority(int priority);
+
+/** Read the per-subchunk sample ranges of one chunk of a dataset written with
+ * option bit 4 (jpegls::OPTION_STATS), without decoding it. With the sec2
+ * driver only the chunk header is read from the file.
+ * @param[in] dset dataset.
+ * @param[in] offset logical position of the chunk in the dataset.
+ * @param[out] stats range and rows of each subchunk.
+ * @return 1 on success; 0 if the chunk has no statistics, e.g. it is not
+ *         written yet, or the dataset applies other filters besides JPEG-LS;
+ *         and -1 on error.
+ */
+int
+h5jpegls_read_chunk_stats(hid_t dset, const hsize_t* offset,
+                          std::vector<jpegls::subchunk_stats_t>& stats);
+
+/** Decode only the preview of one chunk of a dataset written with option
+ * bit 5 (jpegls::OPTION_PREVIEW). With the sec2 driver only the header and
+ * the preview are read from the file.
+ * @param[in] dset dataset.
+ * @param[in] offset logical position of the chunk in the dataset.
+ * @param[out] preview rows * columns samples of the chunk's element size.
+ * @param[out] rows, columns preview geometry; the frames of the chunk are
+ *             stacked along the rows.
+ * @return 1 on success; 0 if the chunk has no preview, e.g. it is not written
+ *         yet, or the dataset applies other filters besides JPEG-LS; and -1
+ *         on error.
+ */
+int
+h5jpegls_read_chunk_preview(hid_t dset, const hsize_t* offset, std::vector<uint8_t>& preview,
+                            size_t& rows, size_t& columns);
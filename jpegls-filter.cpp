@@ -1,12 +1,29 @@
 #include "jpegls-filter.h"
 
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <numeric>
 #include <iostream>
 
+#include <omp.h>
+
 #include "charls/charls.h"
+#include "cpu-quota.h"
+#include "crc32c.h"
+#include "thread-budget.h"
 
 using byte_array_t = std::vector<uint8_t>;
 
+// With -Dmultiversion=true, the loops over raw samples are compiled for
+// AVX-512, AVX2 and baseline x86-64; the loader picks one for the CPU.
+#if defined(H5JPEGLS_MULTIVERSION) && defined(__x86_64__)
+#define SAMPLE_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SAMPLE_KERNEL
+#endif
+
 namespace {
 
 template <typename T>
@@ -24,12 +41,114 @@ struct image_buffer_t {
     uint32_t channels = 1;
 };
 
-/** Given one subchunk of data, compress it and return the encoded data. */
+/** Replicate one sample of typesize bytes (1 or 2) across a 64-bit word. */
+uint64_t
+samplePattern(const uint8_t* sample, size_t typesize) {
+    uint64_t pattern;
+    for (size_t i = 0; i < sizeof(pattern); i += typesize) {
+        memcpy(reinterpret_cast<uint8_t*>(&pattern) + i, sample, typesize);
+    }
+    return pattern;
+}
+
+/** True if all samples equal the first one. The inner loop ORs the
+ * differences of a 64-byte block, which compiles to vector compares, and the
+ * scan stops at the first block that differs.
+ */
+SAMPLE_KERNEL bool
+isConstant(const jpegls::span<const uint8_t> raw, size_t typesize) {
+    if (raw.size < typesize) {
+        return false;
+    }
+
+    const uint64_t pattern = samplePattern(raw.data, typesize);
+    constexpr size_t block_size = 64;
+
+    size_t i = 0;
+    for (; i + block_size <= raw.size; i += block_size) {
+        uint64_t diff = 0;
+        for (size_t j = 0; j < block_size; j += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, raw.data + i + j, sizeof(word));
+            diff |= word ^ pattern;
+        }
+
+        if (diff != 0) {
+            return false;
+        }
+    }
+
+    // i is a multiple of typesize here.
+    for (; i < raw.size; i++) {
+        if (raw[i] != raw[i % typesize]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/** Range of n samples, as the int32_t values stored in the header words. */
 template <typename T>
-byte_array_t
-encodeSubchunk(const image_buffer_t<T> raw, uint32_t lossy = 0) {
-    const auto reserved_size = raw.buffer.size_bytes();
-    byte_array_t encoded(reserved_size + 8192);
+std::array<uint32_t, 2>
+sampleRange(const T* data, size_t n) {
+    T lo = std::numeric_limits<T>::max();
+    T hi = std::numeric_limits<T>::min();
+#pragma omp simd reduction(min : lo) reduction(max : hi)
+    for (size_t i = 0; i < n; i++) {
+        lo = data[i] < lo ? data[i] : lo;
+        hi = data[i] > hi ? data[i] : hi;
+    }
+    return {static_cast<uint32_t>(int32_t{lo}), static_cast<uint32_t>(int32_t{hi})};
+}
+
+/** Smallest and largest sample of a subchunk, as a SIMD min/max reduction,
+ * compared as signed integers with OPTION_SIGNED. */
+SAMPLE_KERNEL std::array<uint32_t, 2>
+subchunkRange(const jpegls::span<const uint8_t> raw, size_t typesize, bool is_signed) {
+    if (raw.size < typesize) {
+        return {0, 0};
+    }
+
+    // Subchunks start on whole rows of the malloc'ed chunk, so samples are aligned.
+    if (typesize == 1) {
+        return is_signed ? sampleRange(reinterpret_cast<const int8_t*>(raw.data), raw.size)
+                         : sampleRange(raw.data, raw.size);
+    }
+    return is_signed ? sampleRange(reinterpret_cast<const int16_t*>(raw.data), raw.size / 2)
+                     : sampleRange(reinterpret_cast<const uint16_t*>(raw.data), raw.size / 2);
+}
+
+/** Fill the subchunk with a single sample value, 64 bits at a time. */
+SAMPLE_KERNEL void
+fillSamples(jpegls::span<uint8_t> raw, const uint8_t* sample, size_t typesize) {
+    const uint64_t pattern = samplePattern(sample, typesize);
+
+    size_t i = 0;
+    for (; i + sizeof(pattern) <= raw.size; i += sizeof(pattern)) {
+        memcpy(raw.data + i, &pattern, sizeof(pattern));
+    }
+
+    for (; i < raw.size; i++) {
+        raw[i] = sample[i % typesize];
+    }
+}
+
+/** Compress one subchunk into out.
+ * @return the encoded size, or 0 if out is too small or the codec fails.
+ */
+template <typename T>
+size_t
+encodeSubchunkTo(const image_buffer_t<T> raw, jpegls::span<uint8_t> out, uint32_t lossy,
+                 bool allow_fill) {
+    // Constant subchunk, e.g. masked or zero-filled: store the fill token.
+    if (allow_fill && isConstant(raw.buffer, raw.typesize)) {
+        if (out.size < raw.typesize) {
+            return 0;
+        }
+        std::copy(raw.buffer.begin(), raw.buffer.begin() + raw.typesize, out.begin());
+        return raw.typesize;
+    }
 
     auto params = [&]() -> const JlsParameters {
         auto params = JlsParameters();
@@ -41,56 +160,339 @@ encodeSubchunk(const image_buffer_t<T> raw, uint32_t lossy = 0) {
         return params;
     }();
 
-    size_t csize;
+    size_t csize = 0;
     char err_msg[256];
     const CharlsApiResultType ret = JpegLsEncode(
-        encoded.data(), encoded.size(), &csize,
+        out.data, out.size, &csize,
         raw.buffer.begin(),
         raw.buffer.size_bytes(), &params, err_msg);
+    if (ret == CharlsApiResultType::CompressedBufferTooSmall) {
+        return 0;
+    }
     if (ret != CharlsApiResultType::OK) {
         std::cerr << "JPEG-LS error: " << err_msg << '\n';
+        return 0;
     }
 
-    encoded.resize(csize);
+    return csize;
+}
 
+/** Given one subchunk of data, compress it and return the encoded data. */
+template <typename T>
+byte_array_t
+encodeSubchunk(const image_buffer_t<T> raw, uint32_t lossy = 0, bool allow_fill = true) {
+    byte_array_t encoded(raw.buffer.size_bytes() + 8192);
+    encoded.resize(encodeSubchunkTo(raw, {encoded.data(), encoded.size()}, lossy, allow_fill));
     return encoded;
 }
+
+/** Shrink one frame by averaging blocks of scale x scale samples; blocks at
+ * the right and bottom edges may be smaller. */
+template <typename T>
+SAMPLE_KERNEL void
+downsampleFrame(const T* in, size_t rows, size_t columns, size_t scale, T* out) {
+    const size_t out_columns = (columns + scale - 1) / scale;
+    std::vector<uint64_t> sums(out_columns);
+
+    for (size_t r = 0; r < rows; r += scale) {
+        const size_t block_rows = std::min(scale, rows - r);
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (size_t i = r; i < r + block_rows; i++) {
+            const T* row = in + i * columns;
+            for (size_t oc = 0; oc < out_columns; oc++) {
+                const size_t end = std::min(columns, (oc + 1) * scale);
+                uint64_t sum = 0;
+                for (size_t c = oc * scale; c < end; c++) {
+                    sum += row[c];
+                }
+                sums[oc] += sum;
+            }
+        }
+
+        for (size_t oc = 0; oc < out_columns; oc++) {
+            const uint64_t count = block_rows * (std::min(columns, (oc + 1) * scale) - oc * scale);
+            *out++ = static_cast<T>((sums[oc] + count / 2) / count);
+        }
+    }
+}
+
+/** Downsample every frame of the chunk and code the stack as one image. */
+byte_array_t
+encodePreview(const jpegls::span<const uint8_t> raw, const jpegls::subchunk_config_t& c) {
+    const size_t columns = c.previewColumns();
+    const size_t frame_bytes = c.frame_rows * c.length * c.typesize;
+    const size_t preview_frame_bytes = c.previewFrameRows() * columns * c.typesize;
+    byte_array_t samples(c.previewRows() * columns * c.typesize);
+
+    for (size_t f = 0; f < c.frames; f++) {
+        const uint8_t* in = raw.data + f * frame_bytes;
+        uint8_t* out = samples.data() + f * preview_frame_bytes;
+        if (c.typesize == 1) {
+            downsampleFrame(in, c.frame_rows, c.length, c.preview_scale, out);
+        } else {
+            downsampleFrame(reinterpret_cast<const uint16_t*>(in), c.frame_rows, c.length,
+                            c.preview_scale, reinterpret_cast<uint16_t*>(out));
+        }
+    }
+
+    const image_buffer_t<const uint8_t> input{
+        {samples.data(), samples.size()}, c.typesize, columns, c.previewRows(), 1};
+    return encodeSubchunk(input, c.lossy, c.has(jpegls::OPTION_FILL));
+}
+
+/** Word i of the chunk header, which need not be aligned. */
+uint32_t
+headerWord(const jpegls::span<const uint8_t> encoded, size_t i) {
+    uint32_t word;
+    memcpy(&word, encoded.data + i * sizeof(word), sizeof(word));
+    return word;
+}
 }
 
 namespace jpegls {
 
+bool
+decodeSubchunk(span<const uint8_t> encoded, span<uint8_t> raw, size_t typesize) {
+    if (typesize != 1 && typesize != 2) {
+        return false;
+    }
+    if (encoded.size == typesize) {
+        fillSamples(raw, encoded.data, typesize);
+        return true;
+    }
+
+    char err_msg[256];
+    const CharlsApiResultType ret =
+        JpegLsDecode(raw.data, raw.size, encoded.data, encoded.size, nullptr, err_msg);
+    if (ret != CharlsApiResultType::OK) {
+        fprintf(stderr, "JPEG-LS error %d: %s\n", static_cast<int>(ret), err_msg);
+        return false;
+    }
+
+    return true;
+}
+
+subchunk_config_t
+getParams(const size_t cd_nelmts, const unsigned int cd_values[]) {
+    // Samples of other sizes cannot be coded, and a typesize of 0 or no
+    // blocks would make the chunk walks loop forever.
+    if (cd_nelmts <= 3 || cd_values[0] == 0 || cd_values[1] == 0 ||
+        (cd_values[2] != 1 && cd_values[2] != 2)) {
+        return {INVALID, 1, 1, 0};
+    }
+
+    int length = cd_values[0];
+    size_t nblocks = cd_values[1];
+    int typesize = cd_values[2];
+    int lossy = cd_values[3];
+    uint32_t options = (cd_nelmts > 4) ? cd_values[4] : 0;
+    size_t threads = (cd_nelmts > 5) ? cd_values[5] : 0;
+    size_t subchunks = (cd_nelmts > 6) ? cd_values[6] : 0;
+    size_t frame_rows = (cd_nelmts > 7) ? cd_values[7] : 0;
+    size_t preview_scale = (cd_nelmts > 8) ? cd_values[8] : 0;
+
+    return {length,  nblocks,   typesize,   lossy,        options,
+            threads, subchunks, frame_rows, preview_scale};
+}
+
+bool
+decodeBlocks(span<const uint8_t> encoded, const subchunk_config_t& c, size_t first, size_t n,
+             span<uint8_t> raw) {
+    const size_t row_bytes = c.length * c.typesize;
+    if (n == 0 || first + n > c.subchunks || encoded.size < c.header_size) {
+        return false;
+    }
+    const size_t first_row = c.rowOffset(first);
+    const size_t last = first + n - 1;
+    if (raw.size < (c.rowOffset(last) + c.rowCount(last) - first_row) * row_bytes) {
+        return false;
+    }
+
+    const node_token_t token;
+
+    size_t offset = c.header_size;
+    for (size_t block = 0; block < first; block++) {
+        offset += headerWord(encoded, block);
+    }
+
+    for (size_t block = first; block < first + n; block++) {
+        const span<const uint8_t> payload{encoded.data + offset, headerWord(encoded, block)};
+        if (offset + payload.size > encoded.size) {
+            return false;
+        }
+        if (c.has(OPTION_CRC32C) &&
+            crc32c(payload.data, payload.size) != headerWord(encoded, c.subchunks + block)) {
+            return false;
+        }
+
+        const size_t row = c.rowOffset(block) - first_row;
+        if (!decodeSubchunk(payload, {raw.data + row * row_bytes, c.rowCount(block) * row_bytes},
+                            c.typesize)) {
+            return false;
+        }
+        offset += payload.size;
+    }
+
+    return true;
+}
+
+bool
+previewExtent(span<const uint8_t> encoded, const subchunk_config_t& c, size_t& offset,
+              size_t& size) {
+    if (!c.has(OPTION_PREVIEW) || encoded.size < c.header_size) {
+        return false;
+    }
+
+    std::vector<uint32_t> header(c.header_size / sizeof(uint32_t));
+    memcpy(header.data(), encoded.data, c.header_size);
+
+    // The preview follows the payloads of all subchunks.
+    offset = std::accumulate(header.begin(), header.begin() + c.subchunks, c.header_size);
+    size = header[c.previewOffset()];
+    return true;
+}
+
+bool
+decodePreview(span<const uint8_t> encoded, const subchunk_config_t& c, span<uint8_t> raw) {
+    const size_t preview_bytes = c.previewRows() * c.previewColumns() * c.typesize;
+    size_t offset;
+    size_t size;
+    if (raw.size < preview_bytes || !previewExtent(encoded, c, offset, size) ||
+        offset + size > encoded.size) {
+        return false;
+    }
+
+    const node_token_t token;
+    return decodeSubchunk({encoded.data + offset, size}, {raw.data, preview_bytes}, c.typesize);
+}
+
+bool
+decodeFrame(span<const uint8_t> encoded, const subchunk_config_t& c, size_t frame,
+            span<uint8_t> raw) {
+    if (frame >= c.frames || raw.size < c.frame_rows * c.length * c.typesize ||
+        encoded.size < c.header_size) {
+        return false;
+    }
+
+    // The chunk may come straight from H5Dread_chunk, so the header is read
+    // without assuming alignment. Like a pool thread, the calling thread
+    // counts against the node-wide thread budget while it decodes.
+    const node_token_t token;
+    const size_t first = c.firstSubchunk(frame);
+    if (c.frames_per_subchunk == 1) {
+        return decodeBlocks(encoded, c, first, c.bands, raw);
+    }
+
+    const size_t frame_bytes = c.frame_rows * c.length * c.typesize;
+    std::vector<uint8_t> group(c.rowCount(first) * c.length * c.typesize);
+    if (!decodeBlocks(encoded, c, first, 1, {group.data(), group.size()})) {
+        return false;
+    }
+    memcpy(raw.data, group.data() + (frame % c.frames_per_subchunk) * frame_bytes, frame_bytes);
+    return true;
+}
+
+bool
+decode(span<const uint8_t> encoded, const subchunk_config_t& c, span<uint8_t> raw) {
+    if (raw.size < c.nblocks * c.length * c.typesize || encoded.size < c.header_size) {
+        return false;
+    }
+
+    const node_token_t token;
+    return decodeBlocks(encoded, c, 0, c.subchunks, raw);
+}
+
+bool
+readStats(span<const uint8_t> encoded, const subchunk_config_t& c,
+          std::vector<subchunk_stats_t>& stats) {
+    if (!c.has(OPTION_STATS) || encoded.size < c.header_size) {
+        return false;
+    }
+
+    stats.resize(c.subchunks);
+    for (size_t block = 0; block < c.subchunks; block++) {
+        int32_t range[2];
+        memcpy(range, encoded.data + (c.statsOffset() + 2 * block) * sizeof(uint32_t),
+               sizeof(range));
+        stats[block] = {range[0], range[1], c.rowOffset(block), c.rowCount(block)};
+    }
+    return true;
+}
+
 span<uint8_t>
-encode(span<uint8_t> raw, const subchunk_config_t c) {
+encode(span<uint8_t> raw, const subchunk_config_t c, const parallel_for_t& parallel_for) {
     std::vector<byte_array_t> local_out(c.subchunks);
+    std::vector<uint32_t> checksum(c.subchunks);
+    std::vector<std::array<uint32_t, 2>> range(c.subchunks);
+
+    // Honor the per-dataset thread cap, if any, then OMP_NUM_THREADS, then
+    // the CPUs that the affinity mask and cgroup quota leave us.
+    const int threads = (c.threads != 0)                ? static_cast<int>(c.threads)
+                        : getenv("OMP_NUM_THREADS") ? omp_get_max_threads()
+                                                        : static_cast<int>(availableCpus());
+
+    const auto for_each_block = [&](const size_t n, const auto& f) {
+        if (parallel_for) {
+            parallel_for(n, f);
+            return;
+        }
+#pragma omp parallel for schedule(guided) num_threads(threads)
+        for (size_t block = 0; block < n; block++) {
+            f(block);
+        }
+    };
+
+    // The preview reads the whole chunk, so it is the first task, and it must
+    // be done before the payloads overwrite the raw data below.
+    byte_array_t preview;
+    const size_t first_block = c.preview_scale ? 1 : 0;
+
+    // No payload is empty, not even a fill token, so that marks a codec error.
+    std::atomic<bool> failed{false};
 
     // For each sub-chunk of raw data, determine the byte range, image width and height.
     // Then, compress data.
-#pragma omp parallel for schedule(guided)
-    for (size_t block = 0; block < c.subchunks; block++) {
-        const size_t width = c.length;
-
-        // Let's say chunk height is 27, not divisible by 24. We have the
-        // remainder of 3. We distribute the remainder by adding additional
-        // single row to the first 3 subchunks.
-        const size_t padded_height = c.lblocks + 1;
-        const size_t height = (block < c.remainder) ? padded_height : c.lblocks;
+    for_each_block(c.subchunks + first_block, [&](const size_t task) {
+        if (task < first_block) {
+            const node_token_t token;
+            preview = encodePreview({raw.data, raw.size}, c);
+            if (preview.empty()) {
+                failed = true;
+            }
+            return;
+        }
 
-        // Now, for the first 3 subchunks, the offset is computed by padded
-        // heights and the block id. The rest has an additional offsets.
-        const size_t offset =
-            c.typesize * width *
-            ((block < c.remainder) ? height * block
-                                   : (padded_height * c.remainder + height * (block - c.remainder)));
+        const size_t block = task - first_block;
+        const size_t width = c.length;
+        const size_t height = c.rowCount(block);
+        const size_t offset = c.typesize * width * c.rowOffset(block);
 
         const image_buffer_t<const uint8_t> input{raw.subspan(offset, width * height * c.typesize),
                                                   c.typesize, width, height, 1};
 
-        local_out[block] = encodeSubchunk(input, c.lossy);
+        const node_token_t token;
+        local_out[block] = encodeSubchunk(input, c.lossy, c.has(OPTION_FILL));
+        if (local_out[block].empty()) {
+            failed = true;
+            return;
+        }
+
+        if (c.has(OPTION_CRC32C)) {
+            checksum[block] = crc32c(local_out[block].data(), local_out[block].size());
+        }
+        if (c.has(OPTION_STATS)) {
+            range[block] = subchunkRange(input.buffer, c.typesize, c.has(OPTION_SIGNED));
+        }
+    });
+
+    if (failed) {
+        return {};
     }
 
     // Compute the total compressed size in bytes.
     const auto compressed_size =
-        std::accumulate(local_out.begin(), local_out.end(), c.header_size,
+        std::accumulate(local_out.begin(), local_out.end(), c.header_size + preview.size(),
                         [](const auto& a, const auto& b) -> size_t { return a + b.size(); });
 
     // Reallocate the raw buffer, if the new size is larger than original size.
@@ -102,10 +504,10 @@ encode(span<uint8_t> raw, const subchunk_config_t c) {
         out_buf = {static_cast<uint8_t*>(realloc(raw.data, compressed_size)), compressed_size};
     }
 
-    span<uint32_t> header{reinterpret_cast<uint32_t*>(out_buf.data), c.subchunks};
+    span<uint32_t> header{reinterpret_cast<uint32_t*>(out_buf.data),
+                          c.header_size / sizeof(uint32_t)};
 
-#pragma omp parallel for schedule(guided)
-    for (size_t block = 0; block < c.subchunks; block++) {
+    for_each_block(c.subchunks, [&](const size_t block) {
         const auto offset = std::accumulate(
             local_out.begin(), local_out.begin() + block, size_t(c.header_size),
             [](const auto& a, const auto& b) -> size_t { return a + b.size(); });
@@ -113,14 +515,79 @@ encode(span<uint8_t> raw, const subchunk_config_t c) {
         const auto& local_buf = local_out[block];
         // Write header
         header[block] = local_buf.size();
+        if (c.has(OPTION_CRC32C)) {
+            header[c.subchunks + block] = checksum[block];
+        }
+        if (c.has(OPTION_STATS)) {
+            header[c.statsOffset() + 2 * block] = range[block][0];
+            header[c.statsOffset() + 2 * block + 1] = range[block][1];
+        }
 
         // Write payload
         std::copy(local_buf.begin(), local_buf.end(), out_buf.begin() + offset);
+    });
+
+    if (c.preview_scale) {
+        header[c.previewOffset()] = preview.size();
+        std::copy(preview.begin(), preview.end(), out_buf.end() - preview.size());
     }
 
     return out_buf;
 }
 
+span<uint8_t>
+encodeSerial(span<const uint8_t> raw, const subchunk_config_t& c) {
+    // Room for the payloads of all but pathological, noise-like data.
+    const size_t capacity = c.header_size + raw.size + raw.size / 2 + 8192;
+    auto* const out = static_cast<uint8_t*>(malloc(capacity));
+    if (out == nullptr) {
+        return {};
+    }
+
+    span<uint32_t> header{reinterpret_cast<uint32_t*>(out), c.header_size / sizeof(uint32_t)};
+    size_t offset = c.header_size;
+
+    const node_token_t token;
+    for (size_t block = 0; block < c.subchunks; block++) {
+        const size_t width = c.length;
+        const size_t height = c.rowCount(block);
+        const image_buffer_t<const uint8_t> input{
+            raw.subspan(c.typesize * width * c.rowOffset(block), width * height * c.typesize),
+            c.typesize, width, height, 1};
+
+        const size_t size = encodeSubchunkTo(input, {out + offset, capacity - offset}, c.lossy,
+                                             c.has(OPTION_FILL));
+        if (size == 0) {
+            free(out);
+            return {};
+        }
+
+        header[block] = size;
+        if (c.has(OPTION_CRC32C)) {
+            header[c.subchunks + block] = crc32c(out + offset, size);
+        }
+        if (c.has(OPTION_STATS)) {
+            const auto range = subchunkRange(input.buffer, c.typesize, c.has(OPTION_SIGNED));
+            header[c.statsOffset() + 2 * block] = range[0];
+            header[c.statsOffset() + 2 * block + 1] = range[1];
+        }
+        offset += size;
+    }
+
+    if (c.preview_scale) {
+        const auto preview = encodePreview(raw, c);
+        if (preview.empty() || offset + preview.size() > capacity) {
+            free(out);
+            return {};
+        }
+        header[c.previewOffset()] = preview.size();
+        std::copy(preview.begin(), preview.end(), out + offset);
+        offset += preview.size();
+    }
+
+    return {out, offset};
+}
+
 #ifdef H5JPEGLS_USE_ASYNC
 std::array<tf::Task, 3>
 encodeAsync(span<const uint8_t> raw, const subchunk_config_t c, tf::Taskflow& taskflow,
@@ -136,17 +603,33 @@ encodeAsync(span<const uint8_t> raw, const subchunk_config_t c, tf::Taskflow& ta
 
     // For each sub-chunk of raw data, determine the byte range, image width and height.
     // Then, compress data.
-    auto scatter_task =
-        taskflow.for_each_index(zero, n_subchunks, one, [&, c, raw](const size_t block) {
+    auto scatter_task = taskflow.for_each_index(
+        zero, n_subchunks + (c.preview_scale ? 1 : 0), one, [&, c, raw](const size_t block) {
+            if (block == c.subchunks) {
+                const node_token_t token;
+                std::get<encode_cache_t>(encoded).preview = encodePreview(raw, c);
+                return;
+            }
+
             const size_t width = c.length;
-            const size_t height =
-                (c.remainder != 0 && block == c.subchunks) ? c.remainder : c.lblocks;
-            const size_t offset = c.typesize * width * height * block;
+            const size_t height = c.rowCount(block);
+            const size_t offset = c.typesize * width * c.rowOffset(block);
             const image_buffer_t<const uint8_t> input{
                 raw.subspan(offset, width * height * c.typesize), c.typesize, width, height, 1};
 
-            auto& local_out = std::get<encode_cache_t>(encoded).local_out.at(block);
-            local_out = encodeSubchunk(input, c.lossy);
+            auto& cache = std::get<encode_cache_t>(encoded);
+            auto& local_out = cache.local_out.at(block);
+            const node_token_t token;
+            // An empty payload marks a codec error for the gather task.
+            local_out = encodeSubchunk(input, c.lossy, c.has(OPTION_FILL));
+
+            if (c.has(OPTION_CRC32C)) {
+                cache.checksum.at(block) = crc32c(local_out.data(), local_out.size());
+            }
+            if (c.has(OPTION_STATS)) {
+                cache.range.at(block) =
+                    subchunkRange(input.buffer, c.typesize, c.has(OPTION_SIGNED));
+            }
         });
 
     // Compute the total compressed size in bytes. We will shrink wrap the
@@ -155,18 +638,30 @@ encodeAsync(span<const uint8_t> raw, const subchunk_config_t c, tf::Taskflow& ta
         auto& compressed_size = std::get<encode_cache_t>(encoded).compressed_size;
         const auto& local_out = std::get<encode_cache_t>(encoded).local_out;
 
+        const size_t preview_size = std::get<encode_cache_t>(encoded).preview.size();
         compressed_size =
-            std::accumulate(local_out.begin(), local_out.end(), c.header_size,
+            std::accumulate(local_out.begin(), local_out.end(), c.header_size + preview_size,
                             [](const auto& a, const auto& b) -> size_t { return a + b.size(); });
     });
 
     auto gather_task = taskflow.emplace([&, c]() {
         const size_t compressed_size = std::get<encode_cache_t>(encoded).compressed_size;
         const auto& local_out = std::get<encode_cache_t>(encoded).local_out;
+        const auto& checksum = std::get<encode_cache_t>(encoded).checksum;
+        const auto& range = std::get<encode_cache_t>(encoded).range;
+
+        const bool preview_failed =
+            c.preview_scale && std::get<encode_cache_t>(encoded).preview.empty();
+        if (preview_failed || std::any_of(local_out.begin(), local_out.end(),
+                                          [](const auto& payload) { return payload.empty(); })) {
+            encoded = byte_array_t{};
+            return;
+        }
 
         byte_array_t encoded_buf(compressed_size);
 
-        span<uint32_t> header{reinterpret_cast<uint32_t*>(encoded_buf.data()), c.subchunks};
+        span<uint32_t> header{reinterpret_cast<uint32_t*>(encoded_buf.data()),
+                              c.header_size / sizeof(uint32_t)};
 
         for (size_t block = 0; block < c.subchunks; block++) {
             const auto offset = std::accumulate(
@@ -177,11 +672,24 @@ encodeAsync(span<const uint8_t> raw, const subchunk_config_t c, tf::Taskflow& ta
 
             // Write header
             header[block] = local_buf.size();
+            if (c.has(OPTION_CRC32C)) {
+                header[c.subchunks + block] = checksum.at(block);
+            }
+            if (c.has(OPTION_STATS)) {
+                header[c.statsOffset() + 2 * block] = range.at(block)[0];
+                header[c.statsOffset() + 2 * block + 1] = range.at(block)[1];
+            }
 
             // Write payload
             std::copy(local_buf.begin(), local_buf.end(), encoded_buf.begin() + offset);
         }
 
+        if (c.preview_scale) {
+            const auto& preview = std::get<encode_cache_t>(encoded).preview;
+            header[c.previewOffset()] = preview.size();
+            std::copy(preview.begin(), preview.end(), encoded_buf.end() - preview.size());
+        }
+
         // move the aggregated data to the output buffer
         encoded = std::move(encoded_buf);
     });
@@ -1,6 +1,8 @@
 #pragma once
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <functional>
 #include <vector>
 
 #ifdef H5JPEGLS_USE_ASYNC
@@ -50,34 +52,310 @@ struct span {
     }
 };
 
+/** Option bits of the filter, i.e. `cd_values[4]`. */
+enum option_t : uint32_t {
+    /** Store the CRC32C of every compressed subchunk in the chunk header. */
+    OPTION_CRC32C = 1u << 0,
+
+    /** Store constant subchunks as fill tokens rather than JPEG-LS streams.
+     * Plugin versions before 0.3 cannot read such chunks. */
+    OPTION_FILL = 1u << 1,
+
+    /** Split 3-D and higher chunks frame by frame rather than along their
+     * flattened rows. Plugin versions before 0.4 cannot read such chunks. */
+    OPTION_FRAMES = 1u << 2,
+
+    /** Schedule the subchunks of this dataset ahead of those of others, e.g.
+     * for interactive reads next to a bulk write. */
+    OPTION_LATENCY = 1u << 3,
+
+    /** Store the minimum and maximum sample of each subchunk in the header,
+     * so that readers can skip subchunks without decoding them. */
+    OPTION_STATS = 1u << 4,
+
+    /** Append a JPEG-LS coded preview of the chunk, each frame shrunk by
+     * preview_scale in both directions, to browse without a full decode. */
+    OPTION_PREVIEW = 1u << 5,
+
+    /** The samples are two's complement integers, so OPTION_STATS ranges
+     * compare them as such. The plugin sets it from the dataset type. */
+    OPTION_SIGNED = 1u << 6,
+};
+
+/** Lane of the chunks of one thread, see h5jpegls_set_priority() in the plugin. */
+enum priority_t : int {
+    PRIORITY_DATASET = 0,
+    PRIORITY_LATENCY = 1,
+    PRIORITY_THROUGHPUT = 2,
+};
+
+/** Length of the layout that getParams returns for malformed parameters. */
+constexpr int INVALID = -1;
+
+/** Each chunk is split into subchunks of whole rows. With OPTION_FRAMES, a
+ * chunk of more than two dimensions is a stack of frames of frame_rows rows
+ * each, and every frame is split into the same number of bands, so no
+ * subchunk crosses a frame edge.
+ * Subchunks are stored as:
+ *
+ *     uint32_t size[subchunks];      compressed size of each subchunk
+ *     uint32_t crc32c[subchunks];    only with OPTION_CRC32C
+ *     int32_t range[subchunks][2];   minimum and maximum sample, only with OPTION_STATS
+ *     uint32_t preview_size;         only with OPTION_PREVIEW
+ *     uint8_t payload[];             JPEG-LS streams, one per subchunk
+ *     uint8_t preview[preview_size]; JPEG-LS stream of the preview
+ *
+ * With OPTION_FILL, a subchunk whose samples all have the same value is stored
+ * as a fill token instead: that value alone, i.e. typesize bytes, which no
+ * JPEG-LS stream is short enough to be mistaken for.
+ *
+ * The HDF5 filter parameters are
+ *
+ *     cd_values = {length, nblocks, typesize, lossy, options, threads, subchunks,
+ *                  frame_rows, preview_scale}
+ *
+ * where older files stop at lossy. threads caps the number of threads that
+ * work on one chunk, and subchunks overrides the default count of 24; zero
+ * means the default for either. No subchunk crosses a frame edge, except that
+ * when the frames outnumber the subchunks, each subchunk holds several whole
+ * frames. A frame_rows of zero makes the whole chunk one frame. The
+ * preview is frames * ceil(frame_rows / preview_scale) rows of
+ * ceil(length / preview_scale) box-averaged samples; preview_scale defaults to 8.
+ */
 struct subchunk_config_t {
     size_t length = 1;
     size_t typesize = 1;
     size_t nblocks = 1;
+    size_t frame_rows = 1;
+    size_t frames = 1;
+    /** Whole frames per subchunk, when the frames outnumber the subchunks. */
+    size_t frames_per_subchunk = 1;
+    /** Subchunks per frame. */
+    size_t bands = 1;
     size_t subchunks = 1;
+    /** Rows per band; the first remainder bands of a frame have one more. */
     size_t lblocks = 1;
     size_t header_size = sizeof(uint32_t);
     size_t remainder = 0;
     size_t lossy = 0;
+    uint32_t options = 0;
+    size_t threads = 0;
+    /** Downsampling factor of the preview, 0 without OPTION_PREVIEW. */
+    size_t preview_scale = 0;
 
-    constexpr subchunk_config_t(int l, size_t _nblocks, size_t t, int _lossy = 0)
+    static constexpr size_t default_subchunks = 24;
+    static constexpr size_t default_preview_scale = 8;
+
+    constexpr subchunk_config_t(int l, size_t _nblocks, size_t t, int _lossy = 0,
+                                uint32_t _options = 0, size_t _threads = 0,
+                                size_t _subchunks = 0, size_t _frame_rows = 0,
+                                size_t _preview_scale = 0)
         : length(l),
           typesize(t),
           nblocks(_nblocks),
-          subchunks(std::min(size_t(24), nblocks)),
-          lblocks(nblocks / subchunks),
-          header_size(sizeof(uint32_t) * subchunks),
-          remainder(nblocks - lblocks * subchunks),
-          lossy(_lossy) {}
+          frame_rows((_frame_rows == 0 || _nblocks % _frame_rows != 0)
+                         ? std::max<size_t>(_nblocks, 1)
+                         : _frame_rows),
+          frames(nblocks / frame_rows),
+          frames_per_subchunk(ceilDiv(frames, (_subchunks == 0) ? default_subchunks : _subchunks)),
+          bands(std::min(ceilDiv((_subchunks == 0) ? default_subchunks : _subchunks, frames),
+                         frame_rows)),
+          subchunks(ceilDiv(frames, frames_per_subchunk) * bands),
+          lblocks(frame_rows / bands),
+          header_size(sizeof(uint32_t) * subchunks *
+                          (1 + ((_options & OPTION_CRC32C) ? 1 : 0) +
+                           ((_options & OPTION_STATS) ? 2 : 0)) +
+                      ((_options & OPTION_PREVIEW) ? sizeof(uint32_t) : 0)),
+          remainder(frame_rows - lblocks * bands),
+          lossy(_lossy),
+          options(_options),
+          threads(_threads),
+          preview_scale(!(_options & OPTION_PREVIEW) ? 0
+                        : (_preview_scale == 0)     ? default_preview_scale
+                                                    : _preview_scale) {}
+
+    /** False for the layout of malformed parameters, see getParams. */
+    constexpr bool isValid() const {
+        return length != static_cast<size_t>(INVALID);
+    }
+
+    constexpr bool has(option_t option) const {
+        return (options & option) != 0;
+    }
+
+    /** First row of a subchunk, counted over the whole chunk. */
+    constexpr size_t rowOffset(size_t block) const {
+        const size_t band = block % bands;
+        return (block / bands) * frames_per_subchunk * frame_rows + band * lblocks +
+               std::min(band, remainder);
+    }
+
+    /** Number of rows in a subchunk; the last group of frames may be short. */
+    constexpr size_t rowCount(size_t block) const {
+        if (frames_per_subchunk > 1) {
+            return std::min(frames_per_subchunk, frames - block * frames_per_subchunk) *
+                   frame_rows;
+        }
+        return lblocks + ((block % bands < remainder) ? 1 : 0);
+    }
+
+    /** First subchunk that holds rows of a frame. */
+    constexpr size_t firstSubchunk(size_t frame) const {
+        return (frame / frames_per_subchunk) * bands;
+    }
+
+    /** Index of the first range word in the uint32_t header. */
+    constexpr size_t statsOffset() const {
+        return subchunks * (has(OPTION_CRC32C) ? 2 : 1);
+    }
+
+    /** Index of the preview size in the uint32_t header. */
+    constexpr size_t previewOffset() const {
+        return statsOffset() + (has(OPTION_STATS) ? 2 * subchunks : 0);
+    }
+
+    /** Preview geometry; each frame contributes previewFrameRows() rows. */
+    constexpr size_t previewColumns() const {
+        return ceilDiv(length, preview_scale);
+    }
+
+    constexpr size_t previewFrameRows() const {
+        return ceilDiv(frame_rows, preview_scale);
+    }
+
+    constexpr size_t previewRows() const {
+        return frames * previewFrameRows();
+    }
+
+   private:
+    static constexpr size_t ceilDiv(size_t a, size_t b) {
+        return (b == 0) ? a : (a + b - 1) / b;
+    }
 };
 
+/** Range of the samples of one subchunk, as stored with OPTION_STATS. */
+struct subchunk_stats_t {
+    /** Sample values; negative ones only with OPTION_SIGNED. */
+    int32_t min = 0;
+    int32_t max = 0;
+    /** First row and number of rows of the subchunk, counted over the chunk. */
+    size_t row = 0;
+    size_t rows = 0;
+};
+
+/** Decode the sub-chunk data layout from the HDF5 filter parameters, i.e. the
+ * `cd_values` written by the set_local callback.
+ * @return a config that is not isValid() if the parameters are malformed,
+ *         e.g. no blocks, or samples of other than 1 or 2 bytes.
+ */
+subchunk_config_t
+getParams(size_t cd_nelmts, const unsigned int cd_values[]);
+
+/** Decompress one subchunk, either a JPEG-LS stream or a fill token.
+ * @param[in] encoded subchunk payload.
+ * @param[out] raw decoded samples, i.e. the rows of the subchunk.
+ * @param[in] typesize bytes per sample.
+ * @return false if the payload cannot be decoded.
+ */
+bool
+decodeSubchunk(span<const uint8_t> encoded, span<uint8_t> raw, size_t typesize);
+
+/** Decompress n consecutive subchunks of a chunk, e.g. as read by
+ * H5Dread_chunk, to skip the others, e.g. those whose statistics rule them
+ * out. See subchunk_config_t::rowOffset and rowCount for their rows.
+ * @param[in] encoded the whole compressed chunk.
+ * @param[in] config layout of the chunk, see getParams.
+ * @param[in] first index of the first subchunk to decode.
+ * @param[in] n number of subchunks, at least 1.
+ * @param[out] raw the rows of the n subchunks, from the first row of subchunk
+ *             first on.
+ * @return false if the range is out of bounds, raw is too short, or the data
+ *         is truncated, fails the CRC32C check or cannot be decoded.
+ */
+bool
+decodeBlocks(span<const uint8_t> encoded, const subchunk_config_t& config, size_t first, size_t n,
+             span<uint8_t> raw);
+
+/** Runs f(0) ... f(n - 1), possibly in parallel, and returns when all are done. */
+using parallel_for_t = std::function<void(size_t n, const std::function<void(size_t)>& f)>;
+
+/** Decompress a single frame of a chunk, e.g. as read by H5Dread_chunk,
+ * without touching the subchunks of the other frames. A frame that shares its
+ * subchunk with others is decoded along with them.
+ * @param[in] encoded the whole compressed chunk.
+ * @param[in] config layout of the chunk, see getParams.
+ * @param[in] frame index of the frame, less than config.frames.
+ * @param[out] raw frame_rows * length * typesize bytes.
+ * @return false if the frame is out of range, or its data is truncated or
+ *         fails the CRC32C check.
+ */
+bool
+decodeFrame(span<const uint8_t> encoded, const subchunk_config_t& config, size_t frame,
+            span<uint8_t> raw);
+
+/** Decompress a whole chunk on the calling thread.
+ * @param[in] encoded the whole compressed chunk.
+ * @param[in] config layout of the chunk, see getParams.
+ * @param[out] raw nblocks * length * typesize bytes.
+ * @return false if the data is truncated, fails the CRC32C check or cannot
+ *         be decoded.
+ */
+bool
+decode(span<const uint8_t> encoded, const subchunk_config_t& config, span<uint8_t> raw);
+
+/** Read the subchunk statistics of a chunk stored with OPTION_STATS.
+ * @param[in] encoded the start of the compressed chunk, at least
+ *            config.header_size bytes; the payload is not needed.
+ * @param[in] config layout of the chunk, see getParams.
+ * @param[out] stats one entry per subchunk.
+ * @return false if the chunk has no statistics or is too short.
+ */
+bool
+readStats(span<const uint8_t> encoded, const subchunk_config_t& config,
+          std::vector<subchunk_stats_t>& stats);
+
+/** Locate the preview of a chunk stored with OPTION_PREVIEW.
+ * @param[in] encoded the start of the compressed chunk, at least
+ *            config.header_size bytes.
+ * @param[out] offset, size byte range of the preview in the chunk.
+ * @return false if the chunk has no preview or the header is too short.
+ */
+bool
+previewExtent(span<const uint8_t> encoded, const subchunk_config_t& config, size_t& offset,
+              size_t& size);
+
+/** Decompress only the preview of a chunk stored with OPTION_PREVIEW.
+ * @param[in] encoded the whole compressed chunk.
+ * @param[in] config layout of the chunk, see getParams.
+ * @param[out] raw previewRows() * previewColumns() * typesize bytes.
+ * @return false if the chunk has no preview, or it is truncated.
+ */
+bool
+decodePreview(span<const uint8_t> encoded, const subchunk_config_t& config, span<uint8_t> raw);
+
 /** Compress one chunk of data, defined by the HDF5 chunk shape.
  * @param[in] raw input data pointer and byte count.
- * @param[in] config sub-chunk data layout to compress in parallel.
- * @param[out] encoded encoded data.
+ * @param[in] config sub-chunk data layout to compress in parallel; its
+ *            threads, if non-zero, sets the size of the OpenMP team.
+ *            Otherwise OMP_NUM_THREADS does, or else the available CPUs.
+ * @param[in] parallel_for runs the subchunks instead of an OpenMP team, e.g.
+ *            in a forked child where the OpenMP runtime of the parent hangs.
+ * @return encoded data, in the reallocated input buffer; or an empty span if
+ *         the codec fails, and the input buffer is left to the caller.
+ */
+span<uint8_t>
+encode(span<uint8_t> buffer, const subchunk_config_t config,
+       const parallel_for_t& parallel_for = nullptr);
+
+/** Compress a small chunk on the calling thread, straight into one new buffer,
+ * without per-subchunk buffers or a thread team.
+ * @param[in] raw input data pointer and byte count; left unchanged.
+ * @param[in] config sub-chunk data layout.
+ * @return the encoded chunk in a malloc'ed buffer, or an empty span if it
+ *         does not fit the size bound, e.g. for noise, or on error.
  */
 span<uint8_t>
-encode(span<uint8_t> buffer, const subchunk_config_t config);
+encodeSerial(span<const uint8_t> raw, const subchunk_config_t& config);
 
 #ifdef H5JPEGLS_USE_ASYNC
 
@@ -86,16 +364,20 @@ using byte_array_t = std::vector<uint8_t>;
 struct encode_cache_t {
     size_t compressed_size;
     std::vector<uint32_t> block_size;
+    std::vector<uint32_t> checksum;
+    std::vector<std::array<uint32_t, 2>> range;
     std::vector<byte_array_t> local_out;
+    byte_array_t preview;
 
     encode_cache_t() = default;
 
-    encode_cache_t(size_t N) : block_size(N), local_out(N) {}
+    encode_cache_t(size_t N) : block_size(N), checksum(N), range(N), local_out(N) {}
 };
 
 using encode_ctx_t = std::variant<encode_cache_t, byte_array_t>;
 
-/** Encode the chunk asychronously */
+/** Encode the chunk asychronously. encoded ends up as the byte array of the
+ * chunk, which is empty if the codec fails. */
 std::array<tf::Task, 3> encodeAsync(span<const uint8_t> raw, const subchunk_config_t config,
                                     tf::Taskflow& taskflow, encode_ctx_t& encoded);
 #endif
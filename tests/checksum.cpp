@@ -0,0 +1,147 @@
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <hdf5.h>
+
+#include "crc32c.h"
+#include "h5jpegls.h"
+#include "jpegls-filter.h"
+#include "synthetic.h"
+
+namespace {
+
+using synthetic::runFilter;
+
+/** The check value of the CRC-32C catalogue, for every implementation. */
+bool
+knownAnswer() {
+    const char* check = "123456789";
+    const auto* data = reinterpret_cast<const uint8_t*>(check);
+    return jpegls::crc32c(data, 9) == 0xE3069283 && jpegls::crc32cPortable(data, 9) == 0xE3069283;
+}
+
+/** The hardware and table implementations agree on every length and alignment. */
+bool
+implementationsAgree() {
+    std::vector<uint8_t> data(300);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = (i * 131 + 7) % 251;
+    }
+
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t size = 0; offset + size <= data.size(); size++) {
+            if (jpegls::crc32c(data.data() + offset, size) !=
+                jpegls::crc32cPortable(data.data() + offset, size)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/** Encode a chunk with OPTION_CRC32C, then flip one byte of a payload and
+ * expect the decode to fail. Small chunks take the inline path of the
+ * plugin, large ones the pool path. */
+bool
+detectsCorruption(unsigned int width, unsigned int height) {
+    const std::vector<unsigned int> cd_values = {width, height, 2, 0, jpegls::OPTION_CRC32C, 0, 0};
+    const auto c = jpegls::getParams(cd_values.size(), cd_values.data());
+
+    std::vector<uint8_t> raw(width * height * 2);
+    for (size_t i = 0; i < raw.size(); i++) {
+        raw[i] = (i * 7 + i / 1024) % 253;
+    }
+
+    const auto encoded = runFilter(0, cd_values, raw);
+    bool ok = !encoded.empty() && runFilter(H5Z_FLAG_REVERSE, cd_values, encoded) == raw;
+
+    auto corrupted = encoded;
+    corrupted[c.header_size + (encoded.size() - c.header_size) / 2] ^= 0x10;
+    ok &= runFilter(H5Z_FLAG_REVERSE, cd_values, corrupted).empty();
+
+    if (!ok) {
+        std::cout << "Corruption of a " << width << "x" << height << " chunk went undetected\n";
+    }
+    return ok;
+}
+
+/** Without OPTION_CRC32C, a broken JPEG-LS stream must still fail the
+ * decode rather than return whatever the codec left in the buffer. */
+bool
+rejectsBrokenStream(unsigned int width, unsigned int height) {
+    const std::vector<unsigned int> cd_values = {width, height, 2, 0, 0, 0, 0};
+    const auto c = jpegls::getParams(cd_values.size(), cd_values.data());
+
+    std::vector<uint8_t> raw(width * height * 2);
+    for (size_t i = 0; i < raw.size(); i++) {
+        raw[i] = (i * 7 + i / 1024) % 253;
+    }
+
+    auto encoded = runFilter(0, cd_values, raw);
+    bool ok = !encoded.empty();
+    if (ok) {
+        // The start of image marker of the first payload.
+        encoded[c.header_size] = 0;
+        ok = runFilter(H5Z_FLAG_REVERSE, cd_values, encoded).empty();
+    }
+
+    if (!ok) {
+        std::cout << "A broken " << width << "x" << height << " stream decoded\n";
+    }
+    return ok;
+}
+
+/** JPEG-LS codes at most 16 bits per sample, so 32-bit data must fail the
+ * encode instead of storing empty payloads. */
+bool
+rejectsUncodableSamples(unsigned int width, unsigned int height) {
+    const std::vector<unsigned int> cd_values = {width, height, 4, 0, 0, 0, 0};
+
+    std::vector<uint8_t> raw(width * height * 4);
+    for (size_t i = 0; i < raw.size(); i++) {
+        raw[i] = i % 251;
+    }
+
+    const bool ok = runFilter(0, cd_values, raw).empty();
+    if (!ok) {
+        std::cout << "A " << width << "x" << height << " chunk of 32-bit samples encoded\n";
+    }
+    return ok;
+}
+
+/** Malformed parameters, e.g. from a damaged file, fail both directions
+ * instead of looping over samples of no size. */
+bool
+rejectsMalformedParameters() {
+    const std::vector<uint8_t> raw(64 * 16 * 2, 1);
+    bool ok = true;
+    for (const auto& cd_values : std::vector<std::vector<unsigned int>>{
+             {64, 16, 0, 0, 0, 0, 0}, {64, 16, 3, 0, 0, 0, 0}, {64, 0, 2, 0, 0, 0, 0}}) {
+        ok &= runFilter(0, cd_values, raw).empty();
+        ok &= runFilter(H5Z_FLAG_REVERSE, cd_values, raw).empty();
+    }
+
+    if (!ok) {
+        std::cout << "Malformed filter parameters were accepted\n";
+    }
+    return ok;
+}
+
+}  // namespace
+
+int
+main() {
+    bool ok = knownAnswer();
+    ok &= implementationsAgree();
+    ok &= detectsCorruption(64, 16);
+    ok &= detectsCorruption(512, 512);
+    ok &= rejectsBrokenStream(64, 16);
+    ok &= rejectsBrokenStream(512, 512);
+    ok &= rejectsUncodableSamples(64, 16);
+    ok &= rejectsUncodableSamples(512, 512);
+    ok &= rejectsMalformedParameters();
+
+    std::cout << (ok ? "OK" : "FAILED") << '\n';
+    return ok ? 0 : 1;
+}
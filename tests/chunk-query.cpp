@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <H5PLextern.h>
+#include <hdf5.h>
+
+#include "h5jpegls.h"
+#include "jpegls-filter.h"
+
+namespace {
+
+constexpr hsize_t frames = 4;
+constexpr hsize_t rows = 30;
+constexpr hsize_t columns = 40;
+constexpr hsize_t chunk_frames = 2;
+
+/** Each frame has its own range of values, so that the stats tell them apart. */
+std::vector<uint16_t>
+makeImage() {
+    std::vector<uint16_t> image(frames * rows * columns);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = 100 + (i / (rows * columns)) * 1000 + (i * 7) % 37;
+    }
+    return image;
+}
+
+/** Write the first chunk of a (frames, rows, columns) dataset, split frame by
+ * frame, leaving the second one unallocated. */
+hid_t
+createDataset(hid_t file, const char* name, unsigned int options, bool shuffle) {
+    const hsize_t dims[] = {frames, rows, columns};
+    const hsize_t chunk[] = {chunk_frames, rows, columns};
+    const hid_t space = H5Screate_simple(3, dims, nullptr);
+    const hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 3, chunk);
+    if (shuffle) {
+        H5Pset_shuffle(dcpl);
+    }
+    const unsigned int cd_values[] = {0, 0, 0, 0, options | jpegls::OPTION_FRAMES};
+    H5Pset_filter(dcpl, H5Z_FILTER_JPEGLS, H5Z_FLAG_MANDATORY, 5, cd_values);
+
+    const hid_t dset =
+        H5Dcreate2(file, name, H5T_NATIVE_UINT16, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    H5Pclose(dcpl);
+
+    const auto image = makeImage();
+    const hsize_t start[] = {0, 0, 0};
+    H5Sselect_hyperslab(space, H5S_SELECT_SET, start, nullptr, chunk, nullptr);
+    const hid_t memspace = H5Screate_simple(3, chunk, nullptr);
+    H5Dwrite(dset, H5T_NATIVE_UINT16, memspace, space, H5P_DEFAULT, image.data());
+    H5Sclose(memspace);
+    H5Sclose(space);
+    return dset;
+}
+
+/** The stats of the first chunk match its rows, and the other chunks have none. */
+bool
+checkStats(hid_t file) {
+    const hid_t dset = createDataset(file, "stats", jpegls::OPTION_STATS, false);
+    const auto image = makeImage();
+
+    const hsize_t first[] = {0, 0, 0};
+    std::vector<jpegls::subchunk_stats_t> stats;
+    bool ok = h5jpegls_read_chunk_stats(dset, first, stats) == 1 && !stats.empty();
+    size_t covered = 0;
+    for (const auto& s : stats) {
+        const auto begin = image.begin() + s.row * columns;
+        const auto range = std::minmax_element(begin, begin + s.rows * columns);
+        ok &= s.min == *range.first && s.max == *range.second && s.row == covered;
+        covered += s.rows;
+    }
+    ok &= covered == chunk_frames * rows;
+
+    const hsize_t unallocated[] = {chunk_frames, 0, 0};
+    ok &= h5jpegls_read_chunk_stats(dset, unallocated, stats) == 0;
+    H5Dclose(dset);
+
+    // Without the option, or under another filter, there is nothing to read.
+    const hid_t plain = createDataset(file, "plain", 0, false);
+    ok &= h5jpegls_read_chunk_stats(plain, first, stats) == 0;
+    H5Dclose(plain);
+
+    const hid_t shuffled = createDataset(file, "shuffled", jpegls::OPTION_STATS, true);
+    ok &= h5jpegls_read_chunk_stats(shuffled, first, stats) == 0;
+    H5Dclose(shuffled);
+
+    return ok;
+}
+
+/** Signed samples are ranged as signed integers, so negative ones are the
+ * minimum rather than the maximum. */
+bool
+checkSignedStats(hid_t file) {
+    const hsize_t dims[] = {rows, columns};
+    const hid_t space = H5Screate_simple(2, dims, nullptr);
+    const hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 2, dims);
+    const unsigned int cd_values[] = {0, 0, 0, 0, jpegls::OPTION_STATS};
+    H5Pset_filter(dcpl, H5Z_FILTER_JPEGLS, H5Z_FLAG_MANDATORY, 5, cd_values);
+
+    const hid_t dset =
+        H5Dcreate2(file, "signed", H5T_NATIVE_INT16, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    H5Pclose(dcpl);
+    H5Sclose(space);
+
+    std::vector<int16_t> image(rows * columns);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = static_cast<int16_t>((i * 37) % 2001) - 1000;
+    }
+    H5Dwrite(dset, H5T_NATIVE_INT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, image.data());
+
+    const hsize_t first[] = {0, 0};
+    std::vector<jpegls::subchunk_stats_t> stats;
+    bool ok = h5jpegls_read_chunk_stats(dset, first, stats) == 1 && !stats.empty();
+    for (const auto& s : stats) {
+        const auto begin = image.begin() + s.row * columns;
+        const auto range = std::minmax_element(begin, begin + s.rows * columns);
+        ok &= s.min == *range.first && s.max == *range.second && s.min < 0;
+    }
+    H5Dclose(dset);
+
+    return ok;
+}
+
+/** The preview of the first chunk is the box average of each of its frames,
+ * and the other chunks have none. */
+bool
+checkPreview(hid_t file) {
+    constexpr size_t scale = jpegls::subchunk_config_t::default_preview_scale;
+    const hid_t dset = createDataset(file, "preview", jpegls::OPTION_PREVIEW, false);
+    const auto image = makeImage();
+
+    const hsize_t first[] = {0, 0, 0};
+    std::vector<uint8_t> preview;
+    size_t preview_rows = 0;
+    size_t preview_columns = 0;
+    const int r = h5jpegls_read_chunk_preview(dset, first, preview, preview_rows, preview_columns);
+    bool ok = r == 1 && preview_rows == chunk_frames * ((rows + scale - 1) / scale) &&
+              preview_columns == (columns + scale - 1) / scale &&
+              preview.size() == preview_rows * preview_columns * sizeof(uint16_t);
+
+    const auto* samples = reinterpret_cast<const uint16_t*>(preview.data());
+    const size_t frame_rows = preview_rows / chunk_frames;
+    for (size_t i = 0; ok && i < preview_rows * preview_columns; i++) {
+        const size_t frame = i / preview_columns / frame_rows;
+        const size_t r = (i / preview_columns) % frame_rows * scale;
+        const size_t col = i % preview_columns * scale;
+
+        uint64_t sum = 0;
+        uint64_t count = 0;
+        for (size_t y = r; y < std::min<size_t>(r + scale, rows); y++) {
+            for (size_t x = col; x < std::min<size_t>(col + scale, columns); x++) {
+                sum += image[(frame * rows + y) * columns + x];
+                count++;
+            }
+        }
+        ok &= samples[i] == (sum + count / 2) / count;
+    }
+
+    const hsize_t unallocated[] = {chunk_frames, 0, 0};
+    ok &= h5jpegls_read_chunk_preview(dset, unallocated, preview, preview_rows,
+                                      preview_columns) == 0;
+    H5Dclose(dset);
+
+    const hid_t plain = createDataset(file, "plain-preview", 0, false);
+    ok &= h5jpegls_read_chunk_preview(plain, first, preview, preview_rows, preview_columns) == 0;
+    H5Dclose(plain);
+
+    const hid_t shuffled = createDataset(file, "shuffled-preview", jpegls::OPTION_PREVIEW, true);
+    ok &=
+        h5jpegls_read_chunk_preview(shuffled, first, preview, preview_rows, preview_columns) == 0;
+    H5Dclose(shuffled);
+
+    return ok;
+}
+
+/** Run the checks on a file of the sec2 driver, whose chunks are read with
+ * pread, and on one of the core driver, which goes through H5Dread_chunk. */
+bool
+runDriver(const char* name, bool core) {
+    const hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (core) {
+        H5Pset_fapl_core(fapl, 1 << 20, false);
+    }
+    const hid_t file = H5Fcreate(name, H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose(fapl);
+
+    const bool ok = file >= 0 && checkStats(file) && checkSignedStats(file) && checkPreview(file);
+    H5Fclose(file);
+
+    if (!ok) {
+        std::cout << "Chunk queries failed with the " << (core ? "core" : "sec2") << " driver\n";
+    }
+    return ok;
+}
+
+}  // namespace
+
+int
+main() {
+    H5Zregister(H5PLget_plugin_info());
+
+    bool ok = runDriver("chunk-query.h5", false);
+    ok &= runDriver("chunk-query-core.h5", true);
+
+    std::cout << (ok ? "OK" : "FAILED") << '\n';
+    return ok ? 0 : 1;
+}
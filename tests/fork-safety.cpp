@@ -0,0 +1,96 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <hdf5.h>
+
+#include "h5jpegls.h"
+#include "jpegls-filter.h"
+
+namespace {
+
+constexpr unsigned width = 512;
+constexpr unsigned height = 512;
+constexpr int children = 8;
+constexpr int iterations = 5;
+
+/* length, nblocks, typesize, lossy, options, threads, subchunks */
+const unsigned int cd_values[] = {width, height, 2, 0, jpegls::OPTION_CRC32C, 0, 0};
+
+std::vector<uint16_t> image;
+
+/** Encode and decode the test image through the filter entry point. */
+bool
+roundtrip() {
+    size_t buf_size = image.size() * sizeof(uint16_t);
+    void* buf = malloc(buf_size);
+    memcpy(buf, image.data(), buf_size);
+
+    const size_t encoded = codec_filter(0, 7, cd_values, buf_size, &buf_size, &buf);
+    const size_t decoded =
+        encoded == 0 ? 0 : codec_filter(H5Z_FLAG_REVERSE, 7, cd_values, encoded, &buf_size, &buf);
+
+    const bool ok = decoded == image.size() * sizeof(uint16_t) &&
+                    memcmp(buf, image.data(), decoded) == 0;
+    free(buf);
+    return ok;
+}
+
+}  // namespace
+
+int
+main() {
+    image.resize(width * height);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (i * 13) % 4000;
+    }
+
+    // Fail rather than hang if a child inherits a dead pool.
+    alarm(60);
+
+    // Start the thread pool in the parent, which encodes and decodes in it.
+    bool ok = roundtrip();
+
+    // Keep the parent busy, so that some forks happen in the middle of a chunk.
+    std::atomic<bool> stop{false};
+    std::atomic<int> parent_failures{0};
+    std::thread background([&] {
+        while (!stop) {
+            parent_failures += !roundtrip();
+        }
+    });
+
+    int child_failures = 0;
+    for (int c = 0; c < children; c++) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            for (int i = 0; i < iterations; i++) {
+                if (!roundtrip()) {
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        child_failures += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    stop = true;
+    background.join();
+
+    std::cout << "Failed children: " << child_failures << " of " << children
+              << ", failed parent chunks: " << parent_failures << '\n';
+    ok &= child_failures == 0 && parent_failures == 0;
+
+    std::cout << (ok ? "OK" : "FAILED") << '\n';
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "jpegls-filter.h"
+
+namespace {
+
+/** Every subchunk lies in one frame, or is a run of whole frames, and together
+ * they cover each row once. */
+bool
+checkLayout(const jpegls::subchunk_config_t& c) {
+    std::vector<int> covered(c.nblocks);
+    for (size_t block = 0; block < c.subchunks; block++) {
+        const size_t first = c.rowOffset(block);
+        const size_t last = first + c.rowCount(block) - 1;
+        const bool whole_frames =
+            first % c.frame_rows == 0 && c.rowCount(block) % c.frame_rows == 0;
+        if (c.rowCount(block) == 0 || last >= c.nblocks ||
+            (first / c.frame_rows != last / c.frame_rows && !whole_frames)) {
+            return false;
+        }
+        for (size_t row = first; row <= last; row++) {
+            covered[row]++;
+        }
+    }
+    for (const int n : covered) {
+        if (n != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Box average of each scale x scale block of every frame, rounded to nearest. */
+std::vector<uint16_t>
+referencePreview(const std::vector<uint16_t>& image, const jpegls::subchunk_config_t& c) {
+    const size_t scale = c.preview_scale;
+    std::vector<uint16_t> preview;
+    for (size_t f = 0; f < c.frames; f++) {
+        const uint16_t* frame = image.data() + f * c.frame_rows * c.length;
+        for (size_t r = 0; r < c.frame_rows; r += scale) {
+            for (size_t col = 0; col < c.length; col += scale) {
+                uint64_t sum = 0;
+                uint64_t count = 0;
+                for (size_t i = r; i < std::min(r + scale, c.frame_rows); i++) {
+                    for (size_t j = col; j < std::min(col + scale, c.length); j++) {
+                        sum += frame[i * c.length + j];
+                        count++;
+                    }
+                }
+                preview.push_back(static_cast<uint16_t>((sum + count / 2) / count));
+            }
+        }
+    }
+    return preview;
+}
+
+/** Encode a stack of frames, then decode each frame on its own. */
+bool
+roundtrip(size_t frames, size_t rows, size_t columns, uint32_t options, size_t subchunks,
+          size_t preview_scale = 0) {
+    const jpegls::subchunk_config_t c(columns, frames * rows, 2, 0, options | jpegls::OPTION_FILL,
+                                      0, subchunks, rows, preview_scale);
+    if (c.frames != frames || !checkLayout(c)) {
+        std::cout << "Bad layout for " << frames << " frames of " << rows << " rows\n";
+        return false;
+    }
+
+    std::vector<uint16_t> image(frames * rows * columns);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (i * 7 + i / columns) % 1024;
+    }
+    // A constant frame, stored as fill tokens.
+    std::fill(image.begin(), image.begin() + rows * columns, 42);
+
+    const size_t raw_size = image.size() * sizeof(uint16_t);
+    auto* buf = static_cast<uint8_t*>(malloc(raw_size));
+    memcpy(buf, image.data(), raw_size);
+
+    // The serial encoder of small chunks writes the same stream.
+    const auto serial =
+        jpegls::encodeSerial({reinterpret_cast<const uint8_t*>(image.data()), raw_size}, c);
+    const auto encoded = jpegls::encode({buf, raw_size}, c);
+
+    bool ok = serial.size == encoded.size && memcmp(serial.data, encoded.data, encoded.size) == 0;
+    free(serial.data);
+
+    std::vector<uint16_t> decoded(image.size());
+    ok &= jpegls::decode({encoded.data, encoded.size}, c,
+                         {reinterpret_cast<uint8_t*>(decoded.data()), raw_size}) &&
+          decoded == image;
+    ok &= !jpegls::decode({encoded.data, encoded.size - 1}, c,
+                          {reinterpret_cast<uint8_t*>(decoded.data()), raw_size}) ||
+          c.has(jpegls::OPTION_PREVIEW);
+
+    std::vector<uint16_t> frame(rows * columns);
+    for (size_t f = 0; f < frames; f++) {
+        ok &= jpegls::decodeFrame({encoded.data, encoded.size}, c, f,
+                                  {reinterpret_cast<uint8_t*>(frame.data()),
+                                   frame.size() * sizeof(uint16_t)}) &&
+              memcmp(frame.data(), image.data() + f * frame.size(),
+                     frame.size() * sizeof(uint16_t)) == 0;
+    }
+    ok &= !jpegls::decodeFrame({encoded.data, encoded.size}, c, frames,
+                               {reinterpret_cast<uint8_t*>(frame.data()),
+                                frame.size() * sizeof(uint16_t)});
+
+    // Any subchunk decodes on its own, without those before it.
+    for (size_t block = 0; block < c.subchunks; block++) {
+        std::vector<uint16_t> rows_out(c.rowCount(block) * columns);
+        ok &= jpegls::decodeBlocks({encoded.data, encoded.size}, c, block, 1,
+                                   {reinterpret_cast<uint8_t*>(rows_out.data()),
+                                    rows_out.size() * sizeof(uint16_t)}) &&
+              std::equal(rows_out.begin(), rows_out.end(),
+                         image.begin() + c.rowOffset(block) * columns);
+    }
+    ok &= !jpegls::decodeBlocks({encoded.data, encoded.size}, c, c.subchunks - 1, 2,
+                                {reinterpret_cast<uint8_t*>(decoded.data()), raw_size});
+
+    // The header alone gives the sample range of every subchunk.
+    std::vector<jpegls::subchunk_stats_t> stats;
+    const bool has_stats = jpegls::readStats({encoded.data, c.header_size}, c, stats);
+    ok &= has_stats == c.has(jpegls::OPTION_STATS);
+    for (size_t block = 0; has_stats && block < c.subchunks; block++) {
+        const auto first = image.begin() + c.rowOffset(block) * columns;
+        const auto range = std::minmax_element(first, first + c.rowCount(block) * columns);
+        ok &= stats[block].min == *range.first && stats[block].max == *range.second &&
+              stats[block].row == c.rowOffset(block) && stats[block].rows == c.rowCount(block);
+    }
+
+    // The preview decodes on its own, without any of the subchunks.
+    std::vector<uint16_t> preview(c.previewRows() * c.previewColumns());
+    const bool has_preview = jpegls::decodePreview(
+        {encoded.data, encoded.size}, c,
+        {reinterpret_cast<uint8_t*>(preview.data()), preview.size() * sizeof(uint16_t)});
+    ok &= has_preview == c.has(jpegls::OPTION_PREVIEW);
+    if (has_preview) {
+        ok &= preview == referencePreview(image, c);
+    }
+    free(encoded.data);
+
+    if (!ok) {
+        std::cout << "Frame decode failed for " << frames << " frames of " << rows << " rows\n";
+    }
+    return ok;
+}
+
+}  // namespace
+
+int
+main() {
+    bool ok = true;
+
+    // Without frames, the layout is the flat one of earlier versions.
+    const jpegls::subchunk_config_t flat(64, 27, 2);
+    ok &= flat.subchunks == 24 && flat.rowOffset(3) == 6 && flat.rowCount(2) == 2 &&
+          flat.rowOffset(4) == 7 && flat.rowCount(4) == 1 && checkLayout(flat);
+
+    ok &= roundtrip(1, 100, 64, 0, 0);
+    ok &= roundtrip(5, 27, 64, 0, 0);
+    ok &= roundtrip(40, 16, 32, jpegls::OPTION_CRC32C, 24);
+    ok &= roundtrip(3, 7, 32, jpegls::OPTION_CRC32C, 100);
+    ok &= roundtrip(6, 20, 48, jpegls::OPTION_STATS, 0);
+    ok &= roundtrip(2, 9, 16, jpegls::OPTION_STATS | jpegls::OPTION_CRC32C, 24);
+    ok &= roundtrip(1, 100, 64, jpegls::OPTION_PREVIEW, 0);
+    ok &= roundtrip(4, 30, 45, jpegls::OPTION_PREVIEW | jpegls::OPTION_CRC32C, 0, 4);
+    ok &= roundtrip(3, 7, 13, jpegls::OPTION_PREVIEW | jpegls::OPTION_STATS, 24, 16);
+
+    // Many small frames share subchunks rather than get one stream each.
+    const jpegls::subchunk_config_t stack(8, 1000 * 8, 2, 0, 0, 0, 0, 8);
+    ok &= stack.subchunks == 24 && stack.frames_per_subchunk == 42 &&
+          stack.rowCount(23) == (1000 - 23 * 42) * 8 && checkLayout(stack);
+    ok &= roundtrip(1000, 8, 8, jpegls::OPTION_CRC32C | jpegls::OPTION_STATS, 0);
+    ok &= roundtrip(50, 5, 16, jpegls::OPTION_PREVIEW, 24, 2);
+
+    std::cout << (ok ? "OK" : "FAILED") << '\n';
+    return ok ? 0 : 1;
+}
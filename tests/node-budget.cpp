@@ -0,0 +1,145 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "thread-budget.h"
+
+namespace {
+
+constexpr int budget = 3;
+constexpr int processes = 4;
+constexpr int threads_per_process = 4;
+constexpr int iterations = 50;
+
+struct counters_t {
+    std::atomic<int> active;
+    std::atomic<int> peak;
+};
+
+/** Hammer the token pool from several threads, and record the peak number
+ * of token holders across all processes. */
+void
+work(counters_t* counters) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_per_process; t++) {
+        threads.emplace_back([counters] {
+            for (int i = 0; i < iterations; i++) {
+                const jpegls::node_token_t token;
+
+                const int active = ++counters->active;
+                int peak = counters->peak.load();
+                while (active > peak && !counters->peak.compare_exchange_weak(peak, active)) {
+                }
+
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                --counters->active;
+            }
+        });
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+/** Fork one process per call, and wait for all of them. */
+template <typename F>
+bool
+runProcesses(int n, F&& f) {
+    std::vector<pid_t> children;
+    for (int p = 0; p < n; p++) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            f();
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+
+    bool ok = true;
+    for (const auto pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        ok &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return ok;
+}
+
+}  // namespace
+
+int
+main() {
+    const std::string name = "/h5jpegls-test-" + std::to_string(getpid());
+    setenv("HDF5_FILTER_NODE_THREADS", std::to_string(budget).c_str(), 1);
+    setenv("HDF5_FILTER_NODE_NAME", name.c_str(), 1);
+
+    // Fail rather than hang if tokens leak.
+    alarm(60);
+
+    // The segment must not be writable by other users unless the umask says so.
+    umask(022);
+
+    auto* counters = static_cast<counters_t*>(mmap(nullptr, sizeof(counters_t),
+                                                   PROT_READ | PROT_WRITE,
+                                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    new (counters) counters_t{};
+
+    bool ok = runProcesses(processes, [&] { work(counters); });
+
+    std::cout << "Peak active codec threads: " << counters->peak << " of " << processes
+              << " processes x " << threads_per_process << " threads, budget " << budget
+              << '\n';
+    ok &= counters->peak > 0 && counters->peak <= budget;
+
+    struct stat st {};
+    ok &= stat(("/dev/shm" + name).c_str(), &st) == 0 && (st.st_mode & 0777) == 0644;
+
+    // A process that dies holding every token must not starve the others.
+    ok &= runProcesses(1, [] {
+        std::vector<std::thread> holders;
+        std::atomic<int> held{0};
+        for (int t = 0; t < budget; t++) {
+            holders.emplace_back([&] {
+                const jpegls::node_token_t token;
+                held++;
+                pause();
+            });
+        }
+        while (held < budget) {
+            std::this_thread::yield();
+        }
+        _exit(0);
+    });
+
+    counters->peak = 0;
+    ok &= runProcesses(1, [&] { work(counters); });
+    ok &= counters->peak > 0 && counters->peak <= budget;
+
+    shm_unlink(name.c_str());
+
+    // A creator that died before initializing the segment leaves it empty;
+    // the next process replaces it rather than run without a budget.
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    ok &= fd >= 0;
+    close(fd);
+    ok &= runProcesses(1, [] {
+        if (jpegls::nodeThreadBudget() != budget) {
+            _exit(1);
+        }
+    });
+
+    shm_unlink(name.c_str());
+
+    std::cout << (ok ? "OK" : "FAILED") << '\n';
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,235 @@
+#include "thread-budget.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr uint32_t ready_magic = 0x4a4c5342;
+
+/** Shared memory layout: a header, followed by one robust, process-shared
+ * mutex per token. Holding the mutex is holding the token. */
+struct shared_budget_t {
+    std::atomic<uint32_t> ready;
+    uint32_t tokens;
+
+    pthread_mutex_t* token() {
+        return reinterpret_cast<pthread_mutex_t*>(this + 1);
+    }
+};
+
+/** Wait up to one second for the creator to finish initializing. */
+template <typename Predicate>
+bool
+waitFor(Predicate&& predicate) {
+    for (int i = 0; i < 1000; i++) {
+        if (predicate()) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+/** Open the segment, or create and initialize it with the given number of
+ * tokens. If its creator does not finish initializing it in time, e.g. it
+ * died in between, return nullptr and the inode of the stale segment.
+ */
+shared_budget_t*
+attach(const char* name, int tokens, ino_t& stale) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    const bool is_creator = fd >= 0;
+    if (is_creator) {
+        const size_t size = sizeof(shared_budget_t) + tokens * sizeof(pthread_mutex_t);
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            shm_unlink(name);
+            fd = -1;
+        }
+    } else if (errno == EEXIST) {
+        fd = shm_open(name, O_RDWR, 0);
+    }
+
+    struct stat st {};
+    if (fd < 0) {
+        return nullptr;
+    }
+    if (!waitFor([&] { return fstat(fd, &st) == 0 && st.st_size > 0; })) {
+        stale = st.st_ino;
+        close(fd);
+        return nullptr;
+    }
+
+    void* addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    auto* budget = static_cast<shared_budget_t*>(addr);
+
+    if (is_creator) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (int i = 0; i < tokens; i++) {
+            pthread_mutex_init(&budget->token()[i], &attr);
+        }
+        pthread_mutexattr_destroy(&attr);
+
+        budget->tokens = tokens;
+        budget->ready.store(ready_magic, std::memory_order_release);
+    } else if (!waitFor([&] {
+                   return budget->ready.load(std::memory_order_acquire) == ready_magic;
+               })) {
+        stale = st.st_ino;
+        munmap(addr, st.st_size);
+        return nullptr;
+    }
+
+    return budget;
+}
+
+/** Remove the segment if it is still the stale one, and not a fresh one that
+ * another process created in its place meanwhile. */
+void
+unlinkStale(const char* name, ino_t stale) {
+    const int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) == 0 && st.st_ino == stale) {
+        shm_unlink(name);
+    }
+    close(fd);
+}
+
+shared_budget_t*
+openBudget() {
+    const char* envvar = getenv("HDF5_FILTER_NODE_THREADS");
+    const int tokens = (envvar != nullptr) ? atoi(envvar) : 0;
+    if (tokens <= 0) {
+        return nullptr;
+    }
+
+    // One budget per user by default, so that other users can neither take
+    // our tokens nor block on a segment we created. Processes of several
+    // users share a budget by name, with a umask that lets them all in.
+    const char* envvar_name = getenv("HDF5_FILTER_NODE_NAME");
+    const std::string default_name = "/h5jpegls-node-threads-" + std::to_string(getuid());
+    const char* name = (envvar_name != nullptr) ? envvar_name : default_name.c_str();
+
+    // A segment left half-initialized by a dead creator would stay so for
+    // good: remove it and create a new one, once.
+    ino_t stale = 0;
+    shared_budget_t* budget = attach(name, tokens, stale);
+    if (budget == nullptr && stale != 0) {
+        unlinkStale(name, stale);
+        stale = 0;
+        budget = attach(name, tokens, stale);
+    }
+
+    if (budget == nullptr) {
+        std::cerr << "Warning: cannot open the node thread budget " << name << ".\n";
+    }
+    return budget;
+}
+
+shared_budget_t*
+budget() {
+    static shared_budget_t* const instance = openBudget();
+    return instance;
+}
+
+/** Tokens held by this thread; only the outermost one takes a mutex. */
+thread_local int tokens_held = 0;
+
+/** A mutex whose owner died is still ours to take, once marked consistent. */
+bool
+locked(shared_budget_t* b, int i, int status) {
+    if (status == EOWNERDEAD) {
+        pthread_mutex_consistent(&b->token()[i]);
+        return true;
+    }
+    return status == 0;
+}
+
+int
+acquire(shared_budget_t* b) {
+    const int n = static_cast<int>(b->tokens);
+
+    // Spread the threads of all processes over the tokens.
+    const int start = static_cast<int>(
+        (std::hash<std::thread::id>{}(std::this_thread::get_id()) ^ getpid()) % n);
+
+    for (;;) {
+        for (int k = 0; k < n; k++) {
+            const int i = (start + k) % n;
+            if (locked(b, i, pthread_mutex_trylock(&b->token()[i]))) {
+                return i;
+            }
+        }
+
+        // All tokens busy. Wait on one of them for a little while, then scan
+        // again, so that a token freed elsewhere is not missed for long.
+        timespec deadline{};
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 2000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        if (locked(b, start, pthread_mutex_timedlock(&b->token()[start], &deadline))) {
+            return start;
+        }
+    }
+}
+
+}  // namespace
+
+namespace jpegls {
+
+node_token_t::node_token_t() {
+    auto* b = budget();
+    if (b == nullptr || tokens_held++ > 0) {
+        return;
+    }
+    index = acquire(b);
+}
+
+node_token_t::~node_token_t() {
+    auto* b = budget();
+    if (b == nullptr) {
+        return;
+    }
+
+    tokens_held--;
+    if (index >= 0) {
+        pthread_mutex_unlock(&b->token()[index]);
+    }
+}
+
+int
+nodeThreadBudget() {
+    auto* b = budget();
+    return (b == nullptr) ? 0 : static_cast<int>(b->tokens);
+}
+
+}  // namespace jpegls
@@ -0,0 +1,35 @@
+#pragma once
+
+namespace jpegls {
+
+/** One token of the node-wide budget of active codec threads.
+ *
+ * When HDF5_FILTER_NODE_THREADS=N is set, all processes on the node that load
+ * the plugin share N tokens through a POSIX shared memory segment, named by
+ * HDF5_FILTER_NODE_NAME (default "/h5jpegls-node-threads-<uid>"). A codec
+ * thread holds a token while it encodes or decodes subchunks, so no more than
+ * N run at once however many processes and thread pools there are. The first
+ * process to create the segment sets N. Tokens held by a process that dies
+ * are returned to the pool, and a segment whose creator died before setting it
+ * up is replaced.
+ *
+ * Without the environment variable, the token is a no-op.
+ */
+class node_token_t {
+   public:
+    /** Block until a token is available. Nested tokens on one thread are free. */
+    node_token_t();
+    ~node_token_t();
+
+    node_token_t(const node_token_t&) = delete;
+    node_token_t& operator=(const node_token_t&) = delete;
+
+   private:
+    int index = -1;
+};
+
+/** Number of node-wide tokens, or 0 if the budget is disabled. */
+int
+nodeThreadBudget();
+
+}  // namespace jpegls
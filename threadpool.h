@@ -1,6 +1,8 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
 #include <queue>
 #include <memory>
@@ -13,6 +15,9 @@
 #include <iostream>
 #include <map>
 #include <chrono>
+
+#include "thread-budget.h"
+
 using std::map;
 using std::vector;
 
@@ -28,14 +33,29 @@ class Worker_buffer {
 
 class ThreadPool {
 public:
-    ThreadPool(size_t);
+    // queued tasks of the latency lane run before those of the throughput lane
+    enum class lane_t { throughput, latency };
+
+    // Workers that find no task for idle_timeout exit and are started again
+    // on demand; zero keeps them waiting forever. Without caller_runs, the
+    // thread that calls parallel_for only waits, as before it took part;
+    // that is for comparison in benchmarks.
+    ThreadPool(size_t, std::chrono::milliseconds idle_timeout = std::chrono::milliseconds(0),
+               bool caller_runs = true);
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args) 
         -> std::future<typename std::result_of<F(Args...)>::type>;
+    template<class F>
+    void parallel_for(size_t n, F&& f, size_t max_threads = 0,
+                      lane_t lane = lane_t::throughput);
     ~ThreadPool();
     
     inline unsigned char* get_buffer(int buffer_id, size_t size) {
-        int ti = tid[std::this_thread::get_id()];
+        int ti;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            ti = tid[std::this_thread::get_id()];
+        }
         if (size > buffers[ti][buffer_id].size) {
             if (buffers[ti][buffer_id].data) {
                 free(buffers[ti][buffer_id].data);
@@ -46,41 +66,76 @@ public:
         return buffers[ti][buffer_id].data;
     }
     
-    inline unsigned char* get_global_buffer(int buffer_id, size_t size) {
+    // take a scratch buffer of at least size bytes for the calling decode
+    // alone, between lock_buffers() and unlock_buffers(); hand it back with
+    // put_global_buffer() so that the next decode reuses it
+    inline Worker_buffer get_global_buffer(size_t size) {
+        size = (size + 15) & ~size_t(15);
         std::lock_guard<std::mutex> lock(gb_mutex);
-        auto it = global_buffers.find(buffer_id);
-        if (it == global_buffers.end()) {
-            global_buffers[buffer_id] = Worker_buffer((unsigned char*)aligned_alloc(16, size), size);
-            return global_buffers[buffer_id].data;
-        } else {
-            if (size > it->second.size) {
-                free(it->second.data);
-                it->second = Worker_buffer((unsigned char*)aligned_alloc(16, size), size);
-            }
-            return it->second.data;
+        if (global_buffers.empty())
+            return Worker_buffer((unsigned char*)aligned_alloc(16, size), size);
+        Worker_buffer b = global_buffers.back();
+        global_buffers.pop_back();
+        if (size > b.size) {
+            free(b.data);
+            b = Worker_buffer((unsigned char*)aligned_alloc(16, size), size);
         }
+        return b;
+    }
+
+    inline void put_global_buffer(Worker_buffer b) {
+        std::lock_guard<std::mutex> lock(gb_mutex);
+        global_buffers.push_back(b);
     }
     
+    // any number of decodes may hold the buffers at once; the sleeper frees
+    // them only once none has for a while
     inline void lock_buffers(void) {
-        sleeper_mutex.lock();
+        std::lock_guard<std::mutex> lock(sleeper_mutex);
+        ++buffer_users;
         buffers_toggled = true;
     }
     
     inline void unlock_buffers(void) {
-        buffers_toggled = true;
-        sleeper_mutex.unlock();
-        sleeper_condition.notify_one();
+        {
+            std::lock_guard<std::mutex> lock(sleeper_mutex);
+            --buffer_users;
+            buffers_toggled = true;
+        }
+        sleeper_condition.notify_all();
     }
     
     int get_threads() const {
         return workers.size();
     }
 
+    // fork() support. prepare_fork() waits for running decodes and takes the
+    // pool locks, parent_after_fork() releases them. The child has none of the
+    // workers, so it calls child_after_fork() to free the buffers and then
+    // abandons the pool instead of destroying it.
+    void prepare_fork();
+    void parent_after_fork();
+    void child_after_fork();
+
 private:
+    void work(size_t i);
+    void start_workers();
+    bool run_latency_task();
+    bool holds_buffers() const;
+
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
-    // the task queue
+    // which worker slots have a live thread, and how many of those run a task
+    vector< bool > running;
+    size_t live;
+    size_t busy;
+    std::chrono::milliseconds idle_timeout;
+    bool caller_runs;
+    // the task queues, one per lane
     std::queue< std::function<void()> > tasks;
+    std::queue< std::function<void()> > latency_tasks;
+    // size of latency_tasks, for throughput work to poll without the lock
+    std::atomic<size_t> latency_queued;
     
     // synchronization
     std::mutex queue_mutex;
@@ -90,78 +145,59 @@ private:
     map< std::thread::id, int > tid;
     vector < vector<Worker_buffer> > buffers;
     
-    map< int, Worker_buffer > global_buffers;
+    // scratch buffers not taken by any decode
+    vector< Worker_buffer > global_buffers;
     std::mutex gb_mutex;
     
     std::thread sleeper;
     std::mutex sleeper_mutex;
     std::condition_variable sleeper_condition;
+    size_t buffer_users;
     bool buffers_toggled;
 };
 
 extern ThreadPool* filter_pool;
  
-// the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads)
-    :   stop(false), buffers_toggled(false)
+// the constructor only sets up the worker slots; threads are started as work
+// arrives and leave again after idle_timeout without any
+inline ThreadPool::ThreadPool(size_t threads, std::chrono::milliseconds idle_timeout,
+                              bool caller_runs)
+    :   workers(threads), running(threads, false), live(0), busy(0),
+        idle_timeout(idle_timeout), caller_runs(caller_runs), latency_queued(0), stop(false), buffer_users(0),
+        buffers_toggled(false)
 {
-    buffers = vector< vector<Worker_buffer> >(threads);
-    for(size_t i = 0;i<threads;++i) {
-        workers.emplace_back(
-            [this]
-            {
-                for(;;)
-                {
-                    std::function<void()> task;
-
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock,
-                            [this]{ return this->stop || !this->tasks.empty(); });
-                        if(this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
+    buffers = vector< vector<Worker_buffer> >(threads, vector<Worker_buffer>(2));
 
-                    task();
-                }
-            }
-        );
-        
-        tid[workers[i].get_id()] = i;
-        buffers[i] = vector<Worker_buffer>(2);
-    }
-    
     sleeper = std::thread( [this] {
         while (true) {
             std::unique_lock<std::mutex> lock(sleeper_mutex);
+            // Nothing to release: sleep until the last decode hands buffers back.
+            sleeper_condition.wait(lock, [this] {
+                return this->stop || (this->buffer_users == 0 && this->holds_buffers());
+            });
+            if (stop) return;
+
             buffers_toggled = false;
             sleeper_condition.wait_for(lock, std::chrono::milliseconds(100), [this] {
                 return this->stop;
             });
             if (stop) return;
-            if (buffers_toggled) continue;
-
-            if (global_buffers.size()) {
-                for (auto& bo: buffers) {
-                    for (auto& bi: bo) {
-                        if (bi.data) {
-                            free(bi.data);
-                            bi.size = 0;
-                            bi.data = 0;
-                        }
-                    }
-                }
-                
-                for (auto& b: global_buffers) {
-                    if (b.second.data) {
-                        free(b.second.data);
-                        b.second.data = 0;
+            if (buffers_toggled || buffer_users > 0) continue;
+
+            for (auto& bo: buffers) {
+                for (auto& bi: bo) {
+                    if (bi.data) {
+                        free(bi.data);
+                        bi.size = 0;
+                        bi.data = 0;
                     }
                 }
-                global_buffers.clear();
             }
+
+            for (auto& b: global_buffers) {
+                free(b.data);
+            }
+            global_buffers.clear();
         }    
     });
     
@@ -192,22 +228,219 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
             throw std::runtime_error("enqueue on stopped ThreadPool");
 
         tasks.emplace([task](){ (*task)(); });
+        start_workers();
     }
     condition.notify_one();
     return res;
 }
 
+// run f(0) ... f(n - 1), with the calling thread claiming indices alongside
+// the workers instead of blocking on futures. Returns once all n are done.
+// At most max_threads threads, the caller included, work on it; 0 means all.
+template<class F>
+void ThreadPool::parallel_for(size_t n, F&& f, size_t max_threads, lane_t lane)
+{
+    if (n == 0)
+        return;
+
+    struct state_t {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    auto state = std::make_shared<state_t>();
+    auto* func = &f;
+
+    // Helpers that start after the caller has drained the indices find
+    // next >= n and return without touching f, so f may go out of scope.
+    // Every thread that does take part holds a node-wide token meanwhile.
+    // Throughput work runs queued latency tasks between its indices, so a
+    // latency decode does not wait for a whole throughput chunk.
+    const auto run = [this, state, func, n, lane] {
+        if (state->next.load() >= n)
+            return;
+
+        jpegls::node_token_t token;
+        for (size_t i = state->next.fetch_add(1); i < n; i = state->next.fetch_add(1)) {
+            while (lane == lane_t::throughput && latency_queued.load() > 0 &&
+                   run_latency_task()) {
+            }
+            (*func)(i);
+            if (state->done.fetch_add(1) + 1 == n) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    const size_t caller = caller_runs ? 1 : 0;
+    size_t helpers = std::min(n - caller, workers.size());
+    if (max_threads > 0)
+        helpers = std::min(helpers, max_threads - caller);
+    if (helpers > 0) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+
+            // don't allow enqueueing after stopping the pool
+            if(stop)
+                throw std::runtime_error("enqueue on stopped ThreadPool");
+
+            auto& queue = (lane == lane_t::latency) ? latency_tasks : tasks;
+            for(size_t i = 0; i < helpers; ++i)
+                queue.emplace(run);
+            latency_queued = latency_tasks.size();
+            start_workers();
+        }
+        if (helpers == 1)
+            condition.notify_one();
+        else
+            condition.notify_all();
+    }
+
+    if (caller_runs)
+        run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&] { return state->done.load() == n; });
+}
+
+// worker loop of slot i; returns on stop or after idle_timeout without tasks
+inline void ThreadPool::work(size_t i)
+{
+    bool had_task = false;
+    for(;;)
+    {
+        std::function<void()> task;
+
+        {
+            std::unique_lock<std::mutex> lock(this->queue_mutex);
+            if (had_task)
+                --busy;
+
+            const auto ready = [this]{
+                return this->stop || !this->tasks.empty() || !this->latency_tasks.empty();
+            };
+            if (idle_timeout.count() > 0) {
+                if (!this->condition.wait_for(lock, idle_timeout, ready)) {
+                    running[i] = false;
+                    --live;
+                    return;
+                }
+            } else {
+                this->condition.wait(lock, ready);
+            }
+            if(this->stop && this->tasks.empty() && this->latency_tasks.empty())
+                return;
+            auto& queue = this->latency_tasks.empty() ? this->tasks : this->latency_tasks;
+            task = std::move(queue.front());
+            queue.pop();
+            latency_queued = latency_tasks.size();
+            ++busy;
+            had_task = true;
+        }
+
+        task();
+    }
+}
+
+// start parked workers while queued tasks outnumber the free ones;
+// called with queue_mutex held
+inline void ThreadPool::start_workers()
+{
+    const size_t queued = tasks.size() + latency_tasks.size();
+    for(size_t i = 0; i < workers.size() && queued > live - busy; ++i) {
+        if (running[i])
+            continue;
+        // a parked worker has returned, or is about to without the lock
+        if (workers[i].joinable()) {
+            tid.erase(workers[i].get_id());
+            workers[i].join();
+        }
+        workers[i] = std::thread(&ThreadPool::work, this, i);
+        tid[workers[i].get_id()] = i;
+        running[i] = true;
+        ++live;
+    }
+}
+
+// pop and run one queued task of the latency lane; false if there is none
+inline bool ThreadPool::run_latency_task()
+{
+    std::function<void()> task;
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (latency_tasks.empty())
+            return false;
+        task = std::move(latency_tasks.front());
+        latency_tasks.pop();
+        latency_queued = latency_tasks.size();
+    }
+    task();
+    return true;
+}
+
+// whether any scratch buffer is allocated; called with sleeper_mutex held
+// and no decode holding the buffers
+inline bool ThreadPool::holds_buffers() const
+{
+    if (!global_buffers.empty())
+        return true;
+    for (auto& bo: buffers) {
+        for (auto& bi: bo) {
+            if (bi.data)
+                return true;
+        }
+    }
+    return false;
+}
+
+inline void ThreadPool::prepare_fork()
+{
+    std::unique_lock<std::mutex> lock(sleeper_mutex);
+    sleeper_condition.wait(lock, [this] { return buffer_users == 0; });
+    lock.release();
+    gb_mutex.lock();
+    queue_mutex.lock();
+}
+
+inline void ThreadPool::parent_after_fork()
+{
+    queue_mutex.unlock();
+    gb_mutex.unlock();
+    sleeper_mutex.unlock();
+}
+
+inline void ThreadPool::child_after_fork()
+{
+    for (auto& bo: buffers) {
+        for (auto& bi: bo) {
+            free(bi.data);
+            bi = Worker_buffer();
+        }
+    }
+    for (auto& b: global_buffers) {
+        free(b.data);
+    }
+    global_buffers.clear();
+    tid.clear();
+}
+
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool()
 {
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        // The workers read stop under queue_mutex and the sleeper under
+        // sleeper_mutex: hold both, so that neither misses the wakeup.
+        std::scoped_lock lock(queue_mutex, sleeper_mutex);
         stop = true;
+        condition.notify_all();
+        sleeper_condition.notify_all();
     }
-    condition.notify_all();
-    sleeper_condition.notify_all();
     for(std::thread &worker: workers) {
-        worker.join();
+        if (worker.joinable())
+            worker.join();
     }
     sleeper.join();
 }